@@ -0,0 +1,70 @@
+#!/usr/bin/env bash
+# Runs the pinned corpus in bench/corpus through $RUNEZ80 and compares the
+# wall time of each run, from process start to exit, against bench/baseline.
+# The baseline only means something on the machine that wrote it, so it is
+# not checked in; it is written on the first run or when BENCH_UPDATE=1.
+# Expects the environment of runez80.sh, with CFLAGS holding no optimization
+# level and no source file, plus CSMITH for the seeds.
+
+dir=$(cd "$(dirname "$0")" && pwd)
+build=$dir/build
+baseline=$dir/baseline
+mkdir -p "$build"
+
+field() {
+    sed -n "s/.*\"$1\":\([0-9.]*\).*/\1/p" "$2"
+}
+
+results=$build/results
+: > "$results"
+grep -v '^#' "$dir/corpus" | while read -r name source flags; do
+    test -n "$name" || continue
+    if ! test -s "$build/$name.bin"; then
+        case $source in
+            seed:*)
+                $CSMITH --seed "${source#seed:}" -o "$build/$name.c" || exit
+                source=$build/$name.c
+                ;;
+            *)
+                source=$dir/$source
+                ;;
+        esac
+        ez80-clang -S $CFLAGS $flags "$source" -o "$build/$name.asm" || exit
+        $FASMG -i "source \"$build/$name.asm\"" "$build/$name.bin" > /dev/null || exit
+    fi
+    wall=$( { TIMEFORMAT=%3R; time $RUNEZ80 $RUNEZ80_FLAGS --stats=json "$build/$name.bin" > /dev/null 2> "$build/$name.stats"; } 2>&1 )
+    stats=$build/$name.stats
+    echo "$name $(field cycles "$stats") $(field init "$stats") $(field load "$stats") $(field execute "$stats") $(field libcalls "$stats") $wall" >> "$results"
+done || exit
+
+if test "$BENCH_UPDATE" = 1 || ! test -s "$baseline"; then
+    awk '{ print $1, $7 }' "$results" > "$baseline"
+    echo "wrote $baseline"
+fi
+
+awk -v baseline="$baseline" '
+    BEGIN {
+        while ((getline line < baseline) > 0) {
+            split(line, f, " ")
+            base[f[1]] = f[2]
+        }
+        printf "%-16s %10s %10s %10s %8s %10s\n", "benchmark", "seconds", "init", "baseline", "change", "MHz"
+    }
+    {
+        seconds = $7
+        run = $5 + $6
+        total += seconds
+        init += $3
+        cycles += $2
+        running += run
+        known = ($1 in base) && base[$1] > 0
+        change = known ? sprintf("%+.1f%%", 100 * (seconds / base[$1] - 1)) : "-"
+        previous = known ? sprintf("%.4f", base[$1]) : "-"
+        printf "%-16s %10.4f %10.4f %10s %8s %10.2f\n", $1, seconds, $3, previous, change,
+               (run > 0 ? $2 / run / 1e6 : 0)
+    }
+    END {
+        printf "\n%d tests in %.3f s, %.3f s of it in init: %.2f tests/s, %.2f emulated MHz\n", NR, total, init,
+               (total > 0 ? NR / total : 0), (running > 0 ? cycles / running / 1e6 : 0)
+    }
+' "$results"
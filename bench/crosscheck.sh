@@ -0,0 +1,38 @@
+#!/bin/sh
+# Runs csmith programs for the seeds FIRST..LAST, at every level in LEVELS,
+# through the interpreter and through each of the modes in MODES, and reports
+# every program whose output or exit status differs between them.  Timeouts
+# are skipped, since the modes count their budgets differently.  Expects the
+# environment of bench.sh.
+
+dir=$(cd "$(dirname "$0")" && pwd)
+build=$dir/build/crosscheck
+mkdir -p "$build"
+: "${FIRST:=1}" "${LAST:=100}" "${LEVELS:=-O0 -Oz -O3}" "${MODES:=--blocks --fast}"
+
+differ=0
+seed=$FIRST
+while test "$seed" -le "$LAST"; do
+    $CSMITH --seed "$seed" -o "$build/$seed.c" || exit
+    for level in $LEVELS; do
+        name=$build/$seed$level
+        ez80-clang -S $CFLAGS $level "$build/$seed.c" -o "$name.asm" || exit
+        $FASMG -i "source \"$name.asm\"" "$name.bin" > /dev/null || exit
+        $RUNEZ80 "$name.bin" > "$name.out"
+        ec=$?
+        test $ec -eq 124 && continue
+        echo "exit code: $ec" >> "$name.out"
+        for mode in $MODES; do
+            $RUNEZ80 $mode "$name.bin" > "$name$mode.out"
+            ec=$?
+            test $ec -eq 124 && continue
+            echo "exit code: $ec" >> "$name$mode.out"
+            if ! cmp -s "$name.out" "$name$mode.out"; then
+                echo "seed $seed $level: $mode differs from the interpreter"
+                differ=1
+            fi
+        done
+    done
+    seed=$((seed + 1))
+done
+exit $differ
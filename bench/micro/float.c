@@ -0,0 +1,15 @@
+/* Float and double arithmetic through the soft-float libcalls. */
+#include "stdint.h"
+
+int main(void)
+{
+	float f = 1.0f;
+	double d = 1.0;
+	int i;
+
+	for (i = 1; i < 5000; i++) {
+		f = f * 1.0001f + 1.0f / (float)i;
+		d = d * 0.9999 + (double)i / 3.0;
+	}
+	return ((long)f ^ (long)d) & 0xff;
+}
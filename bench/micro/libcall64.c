@@ -0,0 +1,14 @@
+/* 64-bit arithmetic, where nearly every operation is a libcall. */
+#include "stdint.h"
+
+int main(void)
+{
+	uint64_t x = 0x123456789abcdefULL, sum = 0;
+	int i;
+
+	for (i = 0; i < 20000; i++) {
+		x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+		sum ^= (x >> 17) + x / 1000003 - (x << 5) % 65521;
+	}
+	return (int)(sum ^ sum >> 32) & 0xff;
+}
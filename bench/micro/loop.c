@@ -0,0 +1,16 @@
+/* A tight loop over 8 and 24-bit integers with no libcalls. */
+#include "stdint.h"
+
+static uint8_t table[256];
+
+int main(void)
+{
+	unsigned int i, j, sum = 0;
+
+	for (i = 0; i < 256; i++)
+		table[i] = (uint8_t)(i * 37 + 11);
+	for (j = 0; j < 400; j++)
+		for (i = 0; i < 256; i++)
+			sum += table[(uint8_t)(i + j)] ^ (uint8_t)j;
+	return sum & 0xff;
+}
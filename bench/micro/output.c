@@ -0,0 +1,25 @@
+/* Output-heavy code: every line goes through putchar and puts. */
+#include "stdint.h"
+
+extern int putchar (int);
+extern int puts (const char *);
+
+int main(void)
+{
+	static const char digits[] = "0123456789";
+	char line[] = "line 0000";
+	int i, j;
+
+	for (i = 0; i < 2000; i++) {
+		int n = i;
+		for (j = 8; j > 4; j--) {
+			line[j] = digits[n % 10];
+			n /= 10;
+		}
+		puts (line);
+		for (j = 0; j < 16; j++)
+			putchar ('a' + j);
+		putchar ('\n');
+	}
+	return 0;
+}
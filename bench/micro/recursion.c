@@ -0,0 +1,23 @@
+/* Deep recursion, dominated by call, ret and frame setup. */
+#include "stdint.h"
+
+static int depth (int n, int acc)
+{
+	if (!n)
+		return acc;
+	return depth (n - 1, acc ^ n) + 1;
+}
+
+static int fib (int n)
+{
+	return n < 2 ? n : fib (n - 1) + fib (n - 2);
+}
+
+int main(void)
+{
+	int i, sum = 0;
+
+	for (i = 0; i < 50; i++)
+		sum += depth (500, i);
+	return (sum + fib (20)) & 0xff;
+}
@@ -1,8 +1,15 @@
 	section	.init
 	public	__start
 __start:
+	ld	hl, __heap
+	call	_heap_init
 	call	_main
 	halt
 	db "exit", 0
 
 	extern	_main
+	extern	_heap_init
+
+	section	.heap
+	public	__heap
+__heap:
@@ -5,6 +5,18 @@
 typedef __SIZE_TYPE__ size_t;
 
 extern int putchar (int);
+#if __SIZEOF_POINTER__ == 3
+extern void putbuf (const void *, size_t);
+#else
+static void
+putbuf (const void *buf, size_t len)
+{
+	const unsigned char *p;
+
+	for (p = buf; len; --len)
+		putchar (*p++);
+}
+#endif
 
 extern void *memcpy (void *restrict, const void *restrict, size_t);
 extern void *memset (void *, int, size_t);
@@ -14,48 +26,36 @@ static inline void platform_main_begin(void)
 {
 }
 
-static uint32_t crc32_tab[256];
 static uint32_t crc32_context = 0xFFFFFFFFUL;
 
-static void 
-crc32_gentab (void)
+#if __SIZEOF_POINTER__ == 3
+/* The table lookups run on the host, see crc32_update in runez80.cpp. */
+extern uint32_t crc32_update (uint32_t, uint64_t);
+#else
+static uint32_t
+crc32_update (uint32_t crc, uint64_t val)
 {
-	uint32_t crc;
-	const uint32_t poly = 0xEDB88320UL;
-	int i, j;
-	
-	for (i = 0; i < 256; i++) {
-		crc = i;
-		for (j = 8; j > 0; j--) {
-			if (crc & 1) {
-				crc = (crc >> 1) ^ poly;
-			} else {
-				crc >>= 1;
-			}
-		}
-		crc32_tab[i] = crc;
+	int i;
+
+	crc ^= (uint32_t)val;
+	for (i = 0; i < 64; i++) {
+		if (i == 32)
+			crc ^= (uint32_t)(val >> 32);
+		crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320UL : 0);
 	}
+	return crc;
 }
+#endif
 
 static void 
-crc32_byte (uint8_t b)
+crc32_gentab (void)
 {
-	crc32_context = 
-		((crc32_context >> 8) & 0x00FFFFFF) ^ 
-		crc32_tab[(crc32_context ^ b) & 0xFF];
 }
 
 static void 
 crc32_8bytes (uint64_t val)
 {
-	crc32_byte ((val>>0) & 0xff);
-	crc32_byte ((val>>8) & 0xff);
-	crc32_byte ((val>>16) & 0xff);
-	crc32_byte ((val>>24) & 0xff);
-	crc32_byte ((val>>32) & 0xff);
-	crc32_byte ((val>>40) & 0xff);
-	crc32_byte ((val>>48) & 0xff);
-	crc32_byte ((val>>56) & 0xff);
+	crc32_context = crc32_update (crc32_context, val);
 }
 
 static void 
@@ -64,24 +64,16 @@ transparent_crc (uint64_t val, char* vname, int flag)
 	crc32_8bytes(val);
 }
 
-static inline void
-puthex (int x)
-{
-    putchar ("0123456789abcdef"[x]);
-}
-
 static inline void
 platform_main_end (uint32_t x, int flag)
 {
   if (!flag) {
-    const char *s;
+    char buf[] = "checksum = XXXXXXXX\n";
     int i;
-    for (s = "checksum = "; *s; ++s)
-      putchar (*s);
     for (i=0; i<8; i++) {
-      puthex (x & 0xf);
+      buf[11 + i] = "0123456789abcdef"[x & 0xf];
       x >>= 4;
     }
-    putchar ('\n');
+    putbuf (buf, sizeof(buf) - 1);
   }
 }
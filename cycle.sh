@@ -1,10 +1,3 @@
-#!/bin/bash
-done=false
-until $done; do
-    for opt in 0 1 2 3 s z; do
-        if make check TEST_CFLAGS=-O$opt; then
-            done=true
-            break
-        fi
-    done
-done
+#!/bin/sh
+# Kept for muscle memory; the parallel driver replaced the serial loop.
+exec make fuzz "$@"
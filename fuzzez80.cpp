@@ -0,0 +1,361 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+using namespace std::literals::string_literals;
+namespace fs = std::filesystem;
+
+// Each seed gets fuzz/<seed>/ holding test.c and native.out, with one
+// O<x>/ subdirectory per optimization level linking back to both.  The
+// stages are the ones runez80.sh runs in sequence, selected with STAGE=:
+//
+//   generate -> native ------------------------+
+//            -> compile -O<x> -> assemble -O<x> -> run -O<x>
+//
+// A stage that passes leaves <stage>.passed behind, one that exits 0 found
+// something, and anything else drops the seed (native) or the level.  The
+// run stage never passes: it exits 0 on a mismatch, 124 on a timeout and
+// anything else once the level is done.  A finding only stops the pool once
+// a second run of the stage repeats it.
+enum class stage { generate, native, compile, assemble, run };
+constexpr const char *stage_names[] = {"generate", "native", "compile", "assemble", "run"};
+
+std::string script = "runez80.sh", csmith = "csmith", cflags, root = "fuzz";
+std::vector<std::string> levels = {"0", "1", "2", "3", "s", "z"};
+
+struct seed_state {
+    unsigned long long seed;
+    fs::path dir;
+    std::unique_ptr<std::atomic<int>[]> gates;
+    std::atomic<bool> dropped{};
+    bool keep = false;
+
+    seed_state(unsigned long long seed) : seed(seed), dir(fs::path(root) / std::to_string(seed)),
+                                          gates(new std::atomic<int>[levels.size()]{}) {}
+    ~seed_state();
+};
+
+struct task {
+    std::shared_ptr<seed_state> seed;
+    stage kind;
+    unsigned level;
+};
+
+// Work stealing: every worker pushes and pops at the back of its own deque,
+// so a seed tends to run to completion where it started, and idle workers
+// steal the oldest task from the front of somebody else's.
+struct worker_queue {
+    std::mutex lock;
+    std::deque<task> tasks;
+};
+std::vector<worker_queue> queues;
+std::mutex wake_lock;
+std::condition_variable wake;
+std::atomic<unsigned> pending;
+
+std::atomic<bool> stop;
+volatile std::sig_atomic_t interrupted;
+std::mutex children_lock;
+std::set<pid_t> children;
+
+std::mutex found_lock;
+std::shared_ptr<seed_state> found;
+stage found_stage;
+unsigned found_level;
+
+std::atomic<unsigned long long> next_seed;
+unsigned long long last_seed;
+std::atomic<unsigned long long> seeds_done, seeds_dropped, runs_done;
+
+seed_state::~seed_state() {
+    std::error_code error;
+    if (!keep)
+        fs::remove_all(dir, error);
+    seeds_dropped += dropped;
+    std::fprintf(stderr, "\r%llu seeds (%llu dropped), %llu runs", ++seeds_done, seeds_dropped.load(),
+                 runs_done.load());
+}
+
+void push(unsigned worker, task t) {
+    ++pending;
+    {
+        std::lock_guard<std::mutex> guard(queues[worker].lock);
+        queues[worker].tasks.push_back(std::move(t));
+    }
+    wake.notify_one();
+}
+
+bool pop(unsigned worker, task &t) {
+    for (unsigned i = 0; i != queues.size(); ++i) {
+        auto &queue = queues[(worker + i) % queues.size()];
+        std::lock_guard<std::mutex> guard(queue.lock);
+        if (queue.tasks.empty())
+            continue;
+        if (i) {
+            t = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        } else {
+            t = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        }
+        return true;
+    }
+    return false;
+}
+
+void kill_children() {
+    std::lock_guard<std::mutex> guard(children_lock);
+    for (pid_t child : children)
+        kill(-child, SIGKILL);
+}
+
+// Runs args in dir as the leader of a new process group, so that stopping
+// also takes down whatever the script itself has started.  Returns the exit
+// status, or -1 if it did not exit normally.
+int spawn(const fs::path &dir, const std::string &log, const std::vector<std::string> &args) {
+    std::vector<char *> argv;
+    for (auto &arg : args)
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    argv.push_back(nullptr);
+    pid_t pid;
+    {
+        std::lock_guard<std::mutex> guard(children_lock);
+        if (stop)
+            return -1;
+        pid = fork();
+        if (pid == 0) {
+            setpgid(0, 0);
+            int fd = chdir(dir.c_str()) ? -1 : open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (fd < 0 || dup2(fd, 1) < 0 || dup2(fd, 2) < 0)
+                _exit(127);
+            execvp(argv[0], argv.data());
+            _exit(127);
+        }
+        if (pid < 0) {
+            std::perror("fork");
+            return -1;
+        }
+        setpgid(pid, pid);
+        children.insert(pid);
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+    {
+        std::lock_guard<std::mutex> guard(children_lock);
+        children.erase(pid);
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// Names the stage of t and its level, which the native stage has none of.
+std::string describe(stage kind, unsigned level) {
+    auto name = stage_names[int(kind)] + " stage"s;
+    return kind == stage::native ? name : name + " at -O" + levels[level];
+}
+
+void report(const task &t) {
+    std::lock_guard<std::mutex> guard(found_lock);
+    if (found)
+        return;
+    found = t.seed;
+    found->keep = true;
+    found_stage = t.kind;
+    found_level = t.level;
+    stop = true;
+    kill_children();
+    wake.notify_all();
+}
+
+void execute(unsigned worker, const task &t) {
+    auto &seed = *t.seed;
+    if (seed.dropped)
+        return;
+    if (t.kind == stage::generate) {
+        std::error_code error;
+        fs::remove_all(seed.dir, error);
+        for (auto &level : levels) {
+            auto dir = seed.dir / ("O" + level);
+            fs::create_directories(dir, error);
+            fs::create_symlink("../test.c", dir / "test.c", error);
+            fs::create_symlink("../native.out", dir / "native.out", error);
+        }
+        if (error || spawn(seed.dir, "generate.log",
+                           {"sh", "-c", csmith + " --seed " + std::to_string(seed.seed) + " -o test.c"})) {
+            seed.dropped = true;
+            return;
+        }
+        for (unsigned level = levels.size(); level--;)
+            push(worker, {t.seed, stage::compile, level});
+        push(worker, {t.seed, stage::native, 0});
+        return;
+    }
+    auto dir = t.kind == stage::native ? seed.dir : seed.dir / ("O" + levels[t.level]);
+    auto name = stage_names[int(t.kind)];
+    std::vector<std::string> args = {"env", "STAGE="s + name,
+                                     "CFLAGS=" + cflags + " -O" + levels[t.level] + " test.c", "sh", script};
+    int status = spawn(dir, name + ".log"s, args);
+    if (status == 0 && !stop) {
+        status = spawn(dir, name + ".confirm.log"s, args);
+        if (status == 0)
+            return report(t);
+        if (!stop)
+            std::fprintf(stderr, "\nSeed %llu: %s found something once but not again\n", seed.seed,
+                         describe(t.kind, t.level).c_str());
+    }
+    if (stop)
+        return;
+    if (t.kind == stage::run) {
+        if (status > 0 && status != 124)
+            ++runs_done;
+        return;
+    }
+    if (!fs::exists(dir / (name + ".passed"s))) {
+        if (t.kind == stage::native)
+            seed.dropped = true;
+        return;
+    }
+    switch (t.kind) {
+    case stage::native:
+        for (unsigned level = 0; level != levels.size(); ++level)
+            if (++seed.gates[level] == 2)
+                push(worker, {t.seed, stage::run, level});
+        break;
+    case stage::compile:
+        push(worker, {t.seed, stage::assemble, t.level});
+        break;
+    default:
+        if (++seed.gates[t.level] == 2)
+            push(worker, {t.seed, stage::run, t.level});
+        break;
+    }
+}
+
+// New seeds are only started when there is nothing left to steal, which
+// keeps the number of seeds on disk proportional to the number of workers.
+void work(unsigned worker) {
+    while (!stop) {
+        task t;
+        if (pop(worker, t)) {
+            execute(worker, t);
+            t.seed.reset();
+            if (!--pending)
+                wake.notify_all();
+            continue;
+        }
+        auto seed = next_seed++;
+        if (seed < last_seed) {
+            push(worker, {std::make_shared<seed_state>(seed), stage::generate, 0});
+            continue;
+        }
+        std::unique_lock<std::mutex> guard(wake_lock);
+        if (!pending)
+            break;
+        wake.wait_for(guard, std::chrono::milliseconds(100));
+    }
+    wake.notify_all();
+}
+
+const char *option(const char *arg, const char *name) {
+    auto length = std::strlen(name);
+    return std::strncmp(arg, name, length) ? nullptr : arg + length;
+}
+
+int usage() {
+    std::fputs("usage: fuzzez80 [--jobs=N] [--seed=N] [--count=N] [--opt=LEVEL,...] [--dir=DIR] [--script=FILE]\n",
+               stderr);
+    return 1;
+}
+}
+
+int main(int argc, char **argv) {
+    unsigned jobs = std::thread::hardware_concurrency();
+    unsigned long long count = 0;
+    next_seed = std::chrono::system_clock::now().time_since_epoch() / std::chrono::seconds(1);
+    for (int arg = 1; arg != argc; ++arg)
+        if (auto value = option(argv[arg], "--jobs="))
+            jobs = std::strtoul(value, nullptr, 0);
+        else if (auto value = option(argv[arg], "--seed="))
+            next_seed = std::strtoull(value, nullptr, 0);
+        else if (auto value = option(argv[arg], "--count="))
+            count = std::strtoull(value, nullptr, 0);
+        else if (auto value = option(argv[arg], "--opt=")) {
+            levels.clear();
+            for (const char *level = value; *level; level += *level == ',')
+                levels.emplace_back(level, std::strcspn(level, ",")), level += levels.back().size();
+        } else if (auto value = option(argv[arg], "--dir="))
+            root = value;
+        else if (auto value = option(argv[arg], "--script="))
+            script = value;
+        else
+            return usage();
+    if (!jobs || levels.empty() || std::count(levels.begin(), levels.end(), ""))
+        return usage();
+    if (auto value = std::getenv("CSMITH"))
+        csmith = value;
+    if (auto value = std::getenv("CFLAGS"))
+        cflags = value;
+    script = fs::absolute(script);
+    root = fs::absolute(root);
+    last_seed = count ? next_seed + count : ~0ull;
+
+    std::signal(SIGINT, [](int) { interrupted = true; });
+    std::signal(SIGTERM, [](int) { interrupted = true; });
+    queues = std::vector<worker_queue>(jobs);
+    std::vector<std::thread> workers;
+    std::atomic<unsigned> running{jobs};
+    for (unsigned worker = 0; worker != jobs; ++worker)
+        workers.emplace_back([worker, &running] { work(worker); --running; });
+    while (running) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (interrupted && !stop) {
+            stop = true;
+            kill_children();
+            wake.notify_all();
+        }
+    }
+    for (auto &worker : workers)
+        worker.join();
+    queues.clear();
+    std::fputc('\n', stderr);
+    if (!found)
+        return interrupted ? 130 : 1;
+
+    auto level = "-O" + levels[found_level];
+    auto source = found->dir / "test.c";
+    std::fprintf(stderr, "%s for seed %llu from the %s, kept in %s\n",
+                 found_stage == stage::run ? "Mismatch" : "Finding", found->seed,
+                 describe(found_stage, found_level).c_str(), found->dir.c_str());
+    std::error_code error;
+    fs::copy_file(source, "test.c", fs::copy_options::overwrite_existing, error);
+    fs::copy_file(source, "test.c.orig", fs::copy_options::overwrite_existing, error);
+    if (error) {
+        std::fprintf(stderr, "%s: %s\n", source.c_str(), error.message().c_str());
+        return 1;
+    }
+    auto reduce = std::getenv("REDUCE");
+    if (!reduce)
+        return 0;
+    auto command = reduce + " TEST_CFLAGS="s + level;
+    execl("/bin/sh", "sh", "-c", command.c_str(), nullptr);
+    std::perror("/bin/sh");
+    return 1;
+}
@@ -2,14 +2,37 @@
 #include "emu.h"
 #include "mem.h"
 
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
 #include <cstdarg>
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <iterator>
 #include <limits>
 #include <string>
+#include <string_view>
+#include <tuple>
 #include <type_traits>
 #include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
 
 namespace {
 using namespace std::literals::string_literals;
@@ -83,11 +106,226 @@ RegisterTuple<Types...> regs(Types &&...regs) {
     return RegisterTuple<Types...>(std::forward<Types>(regs)...);
 }
 
+constexpr u32 ram_start = 0xD00000, ram_size = 0x65800;
+// The stack takes the top of ram, and the heap whatever .bss leaves below it.
+constexpr u32 stack_top = 0xD65800, stack_bottom = 0xD60000;
+constexpr u8 halt_opcode = 0x76;
+// Host view of guest ram.
+u8 *ram;
+
+// Host view of length guest bytes at address, or null unless all of them
+// are backed by memory.  Ram, where nearly everything lives, is checked
+// against its bounds directly instead of going through phys_mem_ptr.
+u8 *span(u32 address, u32 length) {
+    if (u32 offset = address - ram_start; offset < ram_size && length <= ram_size - offset)
+        return &ram[offset];
+    return static_cast<u8 *>(phys_mem_ptr(address, length));
+}
+// Host view of the string at address, with its length not counting the
+// terminator, or null if it runs off the end of memory first.
+const char *string_span(u32 address, u32 &length) {
+    if (u32 offset = address - ram_start; offset < ram_size) {
+        auto *str = reinterpret_cast<const char *>(&ram[offset]);
+        auto *end = static_cast<const char *>(std::memchr(str, '\0', ram_size - offset));
+        if (!end)
+            return nullptr;
+        length = end - str;
+        return str;
+    }
+    auto *str = span(address, 1);
+    for (length = 0; auto *p = span(address + length, 1); ++length)
+        if (!*p)
+            return reinterpret_cast<const char *>(str);
+    return nullptr;
+}
+
 template<typename Type> Type &memref(u32 address) {
-    if (auto *ptr = static_cast<Type *>(phys_mem_ptr(address, sizeof(Type))))
-        return *ptr;
+    if (auto *ptr = span(address, sizeof(Type)))
+        return *reinterpret_cast<Type *>(ptr);
     throw "invalid address";
 }
+void code_written(u32 address, u32 length);
+
+// Every libcall is specified once, in libcall.def, which also generates the
+// stubs in libcall.asm and the handler table.  An entry gives the name, a
+// description, then the location of the result followed by those of the
+// arguments, or custom for a handler that finds its own.
+constexpr size libcall_count = 0
+#define LIBCALL(name, ...) + 1
+#include "libcall.def"
+#undef LIBCALL
+    ;
+
+struct heap_block {
+    u32 size;
+    u8 order;
+};
+struct shadow_finding {
+    const char *what;
+    u32 address, pc;
+};
+struct insn {
+    bool (*exec)(const insn &);
+    u8 *x, *y;
+    u32 *xx, *yy;
+    u32 n, m;
+    u32 pc, next;
+    u32 cycles, count;
+};
+struct block {
+    std::vector<insn> insns;
+    std::vector<u8> bytes;
+    u32 pc, epoch;
+    bool step;
+    block *links[2];
+};
+struct trace_entry {
+    u32 word, value;
+};
+struct profile_node {
+    u32 parent, entry;
+    u64 cycles;
+};
+struct libcall_profile {
+    u64 calls;
+    std::chrono::steady_clock::duration time;
+};
+
+// Everything the runner keeps about a guest besides the CEmu machine itself,
+// so that a second guest in the same process only needs a second one of
+// these, and the machine.  Options are shared and stay outside.
+struct runner {
+    struct {
+        std::vector<u8> bytes;
+        size offset;
+        bool enabled, diverged;
+    } expect;
+    // Guest output, written out once the run is over.
+    std::string output;
+    struct {
+        u32 start, top, peak;
+        std::vector<u32> free[25];
+        std::unordered_map<u32, heap_block> live;
+    } heap;
+    std::vector<u8> shadow_map;
+    u32 shadow_pc;
+    std::vector<shadow_finding> shadow_findings;
+    u64 shadow_count;
+    // Maps each address in ram to one more than the index of the libcall
+    // whose stub name starts there, zero meaning no stub.
+    std::vector<u8> libcall_index;
+    // Set once the guest is known never to finish, ending the run early with
+    // the timeout status.
+    const char *hang_reason;
+    u64 instructions;
+    std::vector<u8> code_map;
+    std::unordered_map<u32, block> blocks;
+    u32 epoch;
+    bool code_dirty;
+    // Set by anything that changes the machine outside the register file.
+    bool side_effects;
+    std::vector<trace_entry> trace_ring;
+    u32 trace_head;
+    struct {
+        eZ80registers_t saved;
+        u64 power, length;
+    } loop;
+    struct {
+        std::array<u8, 1 << 16> edges;
+        u16 previous;
+        bool libcalls[libcall_count];
+    } coverage;
+    struct {
+        std::vector<profile_node> nodes;
+        std::unordered_map<u64, u32> children;
+        // Innermost last, as node and stack pointer.
+        std::vector<std::pair<u32, u32>> stack;
+        std::vector<u64> cycles, counts;
+        libcall_profile libcalls[libcall_count];
+    } profile;
+    struct {
+        std::chrono::steady_clock::duration init, load, execute, libcalls;
+        u64 calls[libcall_count];
+        u32 lowest_sp;
+        std::vector<u8> stack;
+    } stats;
+    // Ram as asic_init left it, which checkpoints are taken against.
+    std::vector<u8> pristine_ram;
+} guest;
+
+// With --expect, guest output is compared against the expected bytes as it
+// is produced, and the run stops at the first difference.
+
+// Checks the next output byte, or the end of the output when c is EOF.
+void compare(int c) {
+    auto &expect = guest.expect;
+    if (expect.diverged)
+        return;
+    if (c != EOF && expect.offset < expect.bytes.size() && expect.bytes[expect.offset] == u8(c)) {
+        ++expect.offset;
+        return;
+    }
+    if (c == EOF && expect.offset == expect.bytes.size())
+        return;
+    expect.diverged = true;
+    std::fprintf(stderr, "Output differs at offset %zu: expected ", expect.offset);
+    if (expect.offset < expect.bytes.size())
+        std::fprintf(stderr, "0x%02X", expect.bytes[expect.offset]);
+    else
+        std::fputs("end of output", stderr);
+    if (c != EOF)
+        std::fprintf(stderr, ", got 0x%02X\n", u8(c));
+    else
+        std::fputs(", got end of output\n", stderr);
+}
+
+void put(const char *data, size length) {
+    if (guest.expect.enabled)
+        for (size i = 0; i != length && !guest.expect.diverged; ++i)
+            compare(u8(data[i]));
+    guest.output.append(data, length);
+}
+int put(int c) {
+    char data = c;
+    put(&data, 1);
+    return u8(c);
+}
+void flush_output(void) {
+    std::fwrite(guest.output.data(), 1, guest.output.size(), stdout);
+    guest.output.clear();
+}
+
+// Exit status for output that differs from what was expected, kept apart
+// from the 1 that every runner error returns.
+constexpr int mismatch_status = 3;
+
+// Ends an --expect run by also comparing the line runez80.sh appends to the
+// native output.  Returns 0 if everything matched, mismatch_status if it did
+// not, with the output so far written out, and 124 if the guest timed out.
+int finish_expect(u32 status) {
+    if (!guest.expect.diverged && u8(status) != 124) {
+        char line[32];
+        std::snprintf(line, sizeof(line), "exit code: %u\n", u8(status));
+        for (char *c = line; *c; ++c)
+            compare(u8(*c));
+        compare(EOF);
+    }
+    if (guest.expect.diverged)
+        flush_output();
+    return guest.expect.diverged ? mismatch_status : u8(status) == 124 ? 124 : 0;
+}
+
+// Ends a run whose output and status came from elsewhere, the cache or a
+// server, as if it had run here.
+int replay(u32 status) {
+    if (!guest.expect.enabled) {
+        flush_output();
+        return status;
+    }
+    for (char c : guest.output)
+        compare(u8(c));
+    return finish_expect(status);
+}
 
 bool ret() {
     cpu_flush(memref<u24>(r.SPL), true);
@@ -97,14 +335,6 @@ bool ret() {
     return true;
 }
 template<typename Result> bool ret(Result result) = delete;
-template<> bool ret<u8>(u8 result) {
-    regs(r.A) = result;
-    return ret();
-}
-template<> bool ret<u16>(u16 result) {
-    regs(r.HL) = result;
-    return ret();
-}
 template<> bool ret<u24>(u24 result) {
     regs(r.HL) = result;
     return ret();
@@ -113,16 +343,190 @@ template<> bool ret<u32>(u32 result) {
     regs(r.E, r.HL) = result;
     return ret();
 }
-bool retL(u32 result) {
-    regs(r.A, r.BC) = result;
-    return ret();
+// Shadow memory for --shadow, one state per ram byte.  The image and .bss
+// start out defined, the stack, live heap blocks and every frame set up by
+// _frameset start out undefined, and the rest of the heap is in no section
+// at all.  Block engine reads of bytes that are not defined and accesses of
+// bytes in no section are reported with the pc of the instruction.  Loads
+// wider than a byte are only checked at their lowest byte, because the
+// compiler widens loads of narrower values upwards.  Copies carry undefined
+// bytes along instead of checking them, so padding can be copied freely, but
+// still report bytes in no section.  Of what the interpreter writes for the
+// instructions it steps, only pushes are seen, so findings are leads rather
+// than verdicts.
+namespace shadow {
+constexpr u8 unmapped = 0, undefined = 1, defined = 2;
 }
-template<> bool ret<u64>(u64 result) {
-    regs(r.BCS, r.DE, r.HL) = result;
-    return ret();
+bool shadow_enabled;
+constexpr size shadow_max_findings = 32;
+
+void start_shadow(void) {
+    guest.shadow_map.assign(ram_size, shadow::defined);
+    std::fill(&guest.shadow_map[stack_bottom - ram_start], &guest.shadow_map[stack_top - ram_start], shadow::undefined);
+    guest.shadow_findings.clear();
+    guest.shadow_count = 0;
+}
+
+// Findings are kept once per kind and pc.
+void shadow_flag(const char *what, u32 address, u32 pc) {
+    ++guest.shadow_count;
+    for (auto &finding : guest.shadow_findings)
+        if (finding.what == what && finding.pc == pc)
+            return;
+    if (guest.shadow_findings.size() != shadow_max_findings)
+        guest.shadow_findings.push_back({what, address, pc});
+}
+
+void shadow_set(u32 address, u32 length, u8 state) {
+    if (u32 offset = address - ram_start; shadow_enabled && offset < ram_size)
+        std::memset(&guest.shadow_map[offset], state, std::min(length, ram_size - offset));
+}
+
+void shadow_read(u32 offset) {
+    if (u8 state = guest.shadow_map[offset]; state != shadow::defined)
+        shadow_flag(state ? "read of uninitialized memory" : "read outside the linked sections",
+                    offset + ram_start, guest.shadow_pc);
+}
+
+void shadow_write(u32 offset) {
+    if (guest.shadow_map[offset] == shadow::unmapped)
+        shadow_flag("write outside the linked sections", offset + ram_start, guest.shadow_pc);
+    else
+        guest.shadow_map[offset] = shadow::defined;
+}
+
+// Checks that a libcall only consumes defined bytes.
+void shadow_use(u32 address, u32 length) {
+    if (u32 offset = address - ram_start; shadow_enabled && offset < ram_size) {
+        auto *begin = &guest.shadow_map[offset], *end = begin + std::min(length, ram_size - offset);
+        auto *p = std::find_if(begin, end, [](u8 state) { return state != shadow::defined; });
+        if (p != end)
+            shadow_read(p - guest.shadow_map.data());
+    }
+}
+
+// State a copy of the byte at offset carries, which for a byte in no section
+// is undefined once the read has been reported.
+u8 shadow_carry(u32 offset) {
+    u8 state = guest.shadow_map[offset];
+    if (state != shadow::unmapped)
+        return state;
+    shadow_read(offset);
+    return shadow::undefined;
+}
+
+void shadow_move(u32 to, u32 from, u32 length) {
+    u32 to_offset = to - ram_start, from_offset = from - ram_start;
+    if (!shadow_enabled || to_offset >= ram_size || length > ram_size - to_offset || from_offset >= ram_size ||
+        length > ram_size - from_offset)
+        return;
+    std::vector<u8> states(length);
+    for (u32 i = 0; i != length; ++i)
+        states[i] = shadow_carry(from_offset + i);
+    for (u32 i = 0; i != length; ++i)
+        if (guest.shadow_map[to_offset + i] == shadow::unmapped)
+            shadow_write(to_offset + i);
+        else
+            guest.shadow_map[to_offset + i] = states[i];
+}
+
+// Guest heap for malloc and friends, carved out of the ram between the end
+// of .bss, which csmith.asm passes to heap_init, and the stack.  Blocks come
+// in power-of-two classes; freed ones go on a list per class for reuse and
+// new ones are bumped off the top, so a run drops the whole heap by resetting
+// it.  With --redzone=N, every block is fenced by at least N bytes of
+// heap_fill on each side, which free, realloc and the end of the run check,
+// so out-of-bounds writes cost nothing until then.
+u32 redzone;
+constexpr u8 heap_fill = 0xFA;
+
+void reset_heap(void) {
+    guest.heap.start = guest.heap.top = guest.heap.peak = 0;
+    for (auto &list : guest.heap.free)
+        list.clear();
+    guest.heap.live.clear();
 }
+
+// Fills the fences around a block of size bytes at address.
+void fence(u32 address, const heap_block &block) {
+    u8 *base = &ram[address - redzone - ram_start];
+    std::memset(base, heap_fill, redzone);
+    std::memset(base + redzone + block.size, heap_fill, (u32(1) << block.order) - redzone - block.size);
+}
+
+bool fence_intact(u32 address, const heap_block &block) {
+    const u8 *base = &ram[address - redzone - ram_start];
+    auto check = [&](u32 from, u32 to) {
+        auto *p = std::find_if(base + from, base + to, [](u8 c) { return c != heap_fill; });
+        if (p == base + to)
+            return true;
+        std::fprintf(stderr, "Heap block %06X of %u bytes overrun at %06X\n", address, block.size,
+                     u32(p - ram) + ram_start);
+        return false;
+    };
+    return check(0, redzone) && check(redzone + block.size, u32(1) << block.order);
+}
+
+u32 heap_alloc(u32 size) {
+    u32 total = size + 2 * redzone;
+    if (!guest.heap.start || total > stack_bottom - guest.heap.start)
+        return 0;
+    u8 order = 3;
+    while (u32(1) << order < total)
+        ++order;
+    u32 base;
+    if (auto &list = guest.heap.free[order]; !list.empty()) {
+        base = list.back();
+        list.pop_back();
+    } else {
+        if ((u32(1) << order) > stack_bottom - guest.heap.top)
+            return 0;
+        base = guest.heap.top;
+        guest.heap.top += u32(1) << order;
+        guest.heap.peak = std::max(guest.heap.peak, guest.heap.top - guest.heap.start);
+    }
+    heap_block block{size, order};
+    guest.heap.live[base + redzone] = block;
+    if (redzone)
+        fence(base + redzone, block);
+    shadow_set(base + redzone, size, shadow::undefined);
+    return base + redzone;
+}
+
+// Returns false for pointers that were never allocated and for blocks whose
+// fences were overwritten.
+bool heap_free(u32 address) {
+    auto live = guest.heap.live.find(address);
+    if (live == guest.heap.live.end()) {
+        std::fprintf(stderr, "Free of unallocated pointer %06X\n", address);
+        return false;
+    }
+    if (redzone && !fence_intact(address, live->second))
+        return false;
+    shadow_set(address, live->second.size, shadow::unmapped);
+    guest.heap.free[live->second.order].push_back(address - redzone);
+    guest.heap.live.erase(live);
+    return true;
+}
+
+bool heap_intact(void) {
+    bool intact = true;
+    if (redzone)
+        for (auto &[address, block] : guest.heap.live)
+            intact &= fence_intact(address, block);
+    return intact;
+}
+
+// Ends the run when a libcall is handed memory that does not exist.
+bool fail(const char *libcall) {
+    std::fprintf(stderr, "Couldn't perform %s\n", libcall);
+    r.HL = -1;
+    return false;
+}
+
+// Flags of comparing x with y.
 template<typename Value>
-bool cmp(Value x, Value y = Value()) {
+u8 cmp(Value x, Value y = Value()) {
     typedef typename std::make_signed<Value>::type Signed;
     typedef typename std::make_unsigned<Value>::type Unsigned;
     constexpr Unsigned half_mask = std::numeric_limits<Unsigned>::max() >> Unsigned(4);
@@ -135,8 +539,29 @@ bool cmp(Value x, Value y = Value()) {
     f |= __builtin_sub_overflow(Unsigned(x & half_mask), Unsigned(y & half_mask), &unsigned_result) << 4;
     f |= (x == y) << 6;
     f |= (signed_result < 0) << 7;
-    r.F = f;
-    return ret();
+    return f;
+}
+
+// Floats are passed in AUBC with a second operand in EUHL and returned in
+// AUBC, doubles are passed and returned like long longs.
+template<typename To, typename From> To bit_cast(From from) {
+    static_assert(sizeof(To) == sizeof(From));
+    To to;
+    std::memcpy(&to, &from, sizeof(to));
+    return to;
+}
+// Flags with z if equal, s and c if less and p/v if unordered.
+template<typename Value>
+u8 fcmp(Value x, Value y) {
+    auto f = r.F & (1 << 5 | 1 << 3);
+    f |= true << 1;
+    if (x < y)
+        f |= 1 << 7 | 1 << 0;
+    else if (x == y)
+        f |= 1 << 6;
+    else if (!(x > y))
+        f |= 1 << 2;
+    return f;
 }
 template<typename Value>
 Value div(Value x, Value y) {
@@ -147,165 +572,2395 @@ Value rem(Value x, Value y) {
     return y ? x % y : x < Value() ? -x : +x;
 }
 
-const std::unordered_map<std::string, bool (*)()> libcall_handlers = {
-    {"exit"s,       []{ return false; }},
-    {"putchar"s,    []{ return ret(u24(putchar(memref<char>(r.SPL + 3)))); }},
-    {"puts"s,       []{
-                        u24 s = memref<u24>(r.SPL + 3);
-                        u8 *ps;
-                        do {
-                            ps = static_cast<u8 *>(phys_mem_ptr(s++, 1));
-                            if (!ps) {
-                                fprintf(stderr, "Couldn't perfom puts\n");
-                                r.HL = -1;
-                                return false;
-                            }
-                            putchar(*ps);
-                        } while (*ps);
-                        putchar('\n');
-                        return ret(u24{});
-                    }},
-    {"memcpy"s,     []{
-                        u24 dst = memref<u24>(r.SPL + 3);
-                        u24 src = memref<u24>(r.SPL + 6);
-                        u24 len = memref<u24>(r.SPL + 9);
-                        void *pdst = phys_mem_ptr(dst, len);
-                        void *psrc = phys_mem_ptr(src, len);
-                        if (!pdst || !psrc) {
-                            fprintf(stderr, "Couldn't perform memcpy\n");
-                            r.HL = -1;
-                            return false;
-                        }
-                        std::memcpy(pdst, psrc, len);
-                        return ret(dst);
-                    }},
-    {"memset"s,     []{
-                        u24 dst = memref<u24>(r.SPL + 3);
-                        u24 src = memref<u24>(r.SPL + 6);
-                        u24 len = memref<u24>(r.SPL + 9);
-                        void *pdst = phys_mem_ptr(dst, len);
-                        if (!pdst) {
-                            fprintf(stderr, "Couldn't perform memset\n");
-                            r.HL = -1;
-                            return false;
-                        }
-                        std::memset(pdst, src, len);
-                        return ret(dst);
-                    }},
-    {"strcmp"s,     []{
-                        u24 lhs = memref<u24>(r.SPL + 3);
-                        u24 rhs = memref<u24>(r.SPL + 6);
-                        u8 *plhs, *prhs;
-                        do {
-                            plhs = static_cast<u8 *>(phys_mem_ptr(lhs++, 1));
-                            prhs = static_cast<u8 *>(phys_mem_ptr(rhs++, 1));
-                            if (!plhs || !prhs) {
-                                fprintf(stderr, "Couldn't perform strcmp\n");
-                                r.HL = -1;
-                                return false;
-                            }
-                        } while (*plhs && *plhs == *prhs);
-                        return ret(u24(*plhs < *prhs ? -1 : *plhs > *prhs ? 1 : 0));
-                    }},
-    {"_dump"s,      []{
-                        fprintf(stderr, "AF %04X     %04X AF'\nBC %06X %06X BC'\nDE %06X %06X DE'\n"
-                                "HL %06X %06X HL'\nIX %06X %06X SPS\nIY %06X %06X SPL\n\n",
-                                r.AF, r._AF, r.BC, r._BC, r.DE, r._DE,
-                                r.HL, r._HL, r.IX, r.SPS, r.IY, r.SPL);
-                        return ret();
-                    }},
-    {"_frameset0"s, []{
-                        ret();
-                        memref<u24>(r.SPL -= 3) = r.IX;
-                        r.IX = r.SPL;
-                        return true;
-                    }},
-    {"_frameset"s,  []{
-                        ret();
-                        memref<u24>(r.SPL -= 3) = r.IX;
-                        r.IX = r.SPL;
-                        r.SPL += s24(r.HL);
-                        return true;
-                    }},
-    {"_snot"s,      []{ return ret(u16(~r.HLS)); }},
-    {"_inot"s,      []{ return ret(u24(~r.HL)); }},
-    {"_lnot"s,      []{ return ret(u32(~u32(regs(r.E, r.HL)))); }},
-    {"_llnot"s,     []{ return ret(u64(~u64(regs(r.BCS, r.DE, r.HL)))); }},
-    {"_sand"s,      []{ return ret(u16(r.HL & r.BC)); }},
-    {"_iand"s,      []{ return ret(u24(r.HL & r.BC)); }},
-    {"_land"s,      []{ return ret(u32(regs(r.E, r.HL)) & u32(regs(r.A, r.BC))); }},
-    {"_lland"s,     []{ return ret(u64(regs(r.BCS, r.DE, r.HL)) & memref<u64>(r.SPL + 3)); }},
-    {"_sor"s,       []{ return ret(u16(r.HL | r.BC)); }},
-    {"_ior"s,       []{ return ret(u24(r.HL | r.BC)); }},
-    {"_lor"s,       []{ return ret(u32(regs(r.E, r.HL)) | u32(regs(r.A, r.BC))); }},
-    {"_llor"s,      []{ return ret(u64(regs(r.BCS, r.DE, r.HL)) | memref<u64>(r.SPL + 3)); }},
-    {"_sxor"s,      []{ return ret(u16(r.HL ^ r.BC)); }},
-    {"_ixor"s,      []{ return ret(u24(r.HL ^ r.BC)); }},
-    {"_lxor"s,      []{ return ret(u32(regs(r.E, r.HL)) ^ u32(regs(r.A, r.BC))); }},
-    {"_llxor"s,     []{ return ret(u64(regs(r.BCS, r.DE, r.HL)) ^ memref<u64>(r.SPL + 3)); }},
-    {"_bshl"s,      []{ return ret(u8(r.A << r.B)); }},
-    {"_sshl"s,      []{ return ret(u16(r.HL << r.C)); }},
-    {"_ishl"s,      []{ return ret(u24(r.HL << r.C)); }},
-    {"_lshl"s,      []{ return retL(u32(regs(r.A, r.BC)) << r.L); }},
-    {"_llshl"s,     []{ return ret(u64(regs(r.BCS, r.DE, r.HL)) << memref<u8>(r.SPL + 3)); }},
-    {"_bshrs"s,     []{ return ret(u8(s8(r.A) >> r.B)); }},
-    {"_sshrs"s,     []{ return ret(u16(s16(r.HLS) >> r.C)); }},
-    {"_ishrs"s,     []{ return ret(u24(s24(r.HL) >> r.C)); }},
-    {"_lshrs"s,     []{ return retL(s32(regs(r.A, r.BC)) >> r.L); }},
-    {"_llshrs"s,    []{ return ret(u64(s64(regs(r.BCS, r.DE, r.HL)) >> memref<u8>(r.SPL + 3))); }},
-    {"_bshru"s,     []{ return ret(u8(r.A >> r.B)); }},
-    {"_sshru"s,     []{ return ret(u16(r.HLS >> r.C)); }},
-    {"_ishru"s,     []{ return ret(u24(r.HL >> r.C)); }},
-    {"_lshru"s,     []{ return retL(u32(regs(r.A, r.BC)) >> r.L); }},
-    {"_llshru"s,    []{ return ret(u64(regs(r.BCS, r.DE, r.HL)) >> memref<u8>(r.SPL + 3)); }},
-    {"_lcmpu"s,     []{ return cmp(u32(regs(r.E, r.HL)), u32(regs(r.A, r.BC))); }},
-    {"_llcmpu"s,    []{ return cmp(u64(regs(r.BCS, r.DE, r.HL)), memref<u64>(r.SPL + 3)); }},
-    {"_lcmpzero"s,  []{ return cmp(u32(regs(r.E, r.HL))); }},
-    {"_llcmpzero"s, []{ return cmp(u64(regs(r.BCS, r.DE, r.HL))); }},
-    {"_setflag"s,   []{ r.F ^= r.F << 5 & 1 << 7; return ret(); }},
-    {"_sneg"s,      []{ return ret(u16(-r.HLS)); }},
-    {"_ineg"s,      []{ return ret(u24(-r.HL)); }},
-    {"_lneg"s,      []{ return ret(u32(-u32(regs(r.E, r.HL)))); }},
-    {"_llneg"s,     []{ return ret(u64(-u64(regs(r.BCS, r.DE, r.HL)))); }},
-    {"_ladd"s,      []{ return ret(u32(regs(r.E, r.HL)) + u32(regs(r.A, r.BC))); }},
-    {"_lladd"s,     []{ return ret(u64(regs(r.BCS, r.DE, r.HL)) + memref<u64>(r.SPL + 3)); }},
-    {"_lsub"s,      []{ return ret(u32(regs(r.E, r.HL)) - u32(regs(r.A, r.BC))); }},
-    {"_llsub"s,     []{ return ret(u64(regs(r.BCS, r.DE, r.HL)) - memref<u64>(r.SPL + 3)); }},
-    {"_smulu"s,     []{ return ret(u16(r.HLS * r.BCS)); }},
-    {"_imulu"s,     []{ return ret(u24(r.HL * r.BC)); }},
-    {"_lmulu"s,     []{ return ret(u32(regs(r.E, r.HL)) * u32(regs(r.A, r.BC))); }},
-    {"_llmulu"s,    []{ return ret(u64(regs(r.BCS, r.DE, r.HL)) * memref<u64>(r.SPL + 3)); }},
-    {"_bdivs"s,     []{ return ret(u8(div(s8(r.B), s8(r.C)))); }},
-    {"_sdivs"s,     []{ return ret(u16(div(s16(r.HLS), s16(r.BCS)))); }},
-    {"_idivs"s,     []{ return ret(u24(div(s24(r.HL), s24(r.BC)))); }},
-    {"_ldivs"s,     []{ return ret(u32(div(s32(regs(r.E, r.HL)), s32(regs(r.A, r.BC))))); }},
-    {"_lldivs"s,    []{ return ret(u64(div(s64(regs(r.BCS, r.DE, r.HL)), memref<s64>(r.SPL + 3)))); }},
-    {"_bdivu"s,     []{ return ret(u8(div(r.B, r.C))); }},
-    {"_sdivu"s,     []{ return ret(u64(div(r.HLS, r.BCS))); }},
-    {"_idivu"s,     []{ return ret(u24(div(r.HL, r.BC))); }},
-    {"_ldivu"s,     []{ return ret(u32(div(u32(regs(r.E, r.HL)), u32(regs(r.A, r.BC))))); }},
-    {"_lldivu"s,    []{ return ret(u32(div(u64(regs(r.BCS, r.DE, r.HL)), memref<u64>(r.SPL + 3)))); }},
-    {"_brems"s,     []{ return ret(u8(rem(s8(r.A), s8(r.C)))); }},
-    {"_srems"s,     []{ return ret(u16(rem(s16(r.HL), s16(r.BC)))); }},
-    {"_irems"s,     []{ return ret(u24(rem(s24(r.HL), s24(r.BC)))); }},
-    {"_lrems"s,     []{ return ret(u32(rem(s32(regs(r.E, r.HL)), s32(regs(r.A, r.BC))))); }},
-    {"_llrems"s,    []{ return ret(u64(rem(s64(regs(r.BCS, r.DE, r.HL)), memref<s64>(r.SPL + 3)))); }},
-    {"_bremu"s,     []{ return ret(u8(rem(r.A, r.C))); }},
-    {"_sremu"s,     []{ return ret(u16(rem(r.HLS, r.BCS))); }},
-    {"_iremu"s,     []{ return ret(u24(rem(u24(r.HL), u24(r.BC)))); }},
-    {"_lremu"s,     []{ return ret(u32(rem(u32(regs(r.E, r.HL)), u32(regs(r.A, r.BC))))); }},
-    {"_llremu"s,    []{ return ret(u64(rem(u64(regs(r.BCS, r.DE, r.HL)), memref<u64>(r.SPL + 3)))); }},
+// The reflected CRC-32 that csmith checksums globals with, eight bytes at a
+// time using slicing-by-8 tables.
+constexpr auto crc32_tables = [] {
+    std::array<std::array<u32, 256>, 8> tables{};
+    for (u32 i = 0; i != 256; ++i) {
+        u32 crc = i;
+        for (int j = 0; j != 8; ++j)
+            crc = crc >> 1 ^ (crc & 1 ? 0xEDB88320 : 0);
+        tables[0][i] = crc;
+    }
+    for (size k = 1; k != tables.size(); ++k)
+        for (u32 i = 0; i != 256; ++i)
+            tables[k][i] = tables[k - 1][i] >> 8 ^ tables[0][tables[k - 1][i] & 0xFF];
+    return tables;
+}();
+u32 crc32_update(u32 crc, u64 value) {
+    value ^= crc;
+    u32 result = 0;
+    for (size k = 0; k != crc32_tables.size(); ++k)
+        result ^= crc32_tables[7 - k][value >> k * 8 & 0xFF];
+    return result;
+}
+
+// Where libcall.def puts arguments and results: registers and register
+// groups named high to low as in its comments (EUHL is E above UHL), and the
+// stack slots SP3, SP6 and SP9 at that offset from SPL.  Reads hand over the
+// raw bits, which become whatever type the handler takes, floating point
+// included, and results go back the same way.
+template<typename Bits> struct raw {
+    Bits bits;
+    template<typename Type> operator Type() const {
+        if constexpr (std::is_floating_point_v<Type>)
+            return bit_cast<Type>(bits);
+        else
+            return Type(bits);
+    }
+};
+template<typename Bits, typename Value> Bits to_bits(Value value) {
+    if constexpr (std::is_floating_point_v<Value>)
+        return bit_cast<Bits>(value);
+    else
+        return Bits(value);
+}
+#define LOCATION(name, Bits, ...)                                                                           \
+    struct name {                                                                                           \
+        static raw<Bits> get() { return {Bits(regs(__VA_ARGS__))}; }                                        \
+        template<typename Value> static void set(Value value) { regs(__VA_ARGS__) = to_bits<Bits>(value); } \
+    };
+LOCATION(A, u8, r.A)
+LOCATION(B, u8, r.B)
+LOCATION(C, u8, r.C)
+LOCATION(L, u8, r.L)
+LOCATION(F, u8, r.F)
+LOCATION(HL, u16, r.HL)
+LOCATION(BC, u16, r.BC)
+LOCATION(UHL, u32, r.HL)
+LOCATION(UBC, u32, r.BC)
+LOCATION(EUHL, u32, r.E, r.HL)
+LOCATION(AUBC, u32, r.A, r.BC)
+LOCATION(BCUDEUHL, u64, r.BCS, r.DE, r.HL)
+#undef LOCATION
+template<u32 Offset> struct stack_slot {
+    struct value {
+        template<typename Type> operator Type() const {
+            Type result;
+            std::memcpy(&result, memref<u8[sizeof(Type)]>(r.SPL + Offset), sizeof(result));
+            return result;
+        }
+    };
+    static value get() { return {}; }
 };
+using SP3 = stack_slot<3>;
+using SP6 = stack_slot<6>;
+using SP9 = stack_slot<9>;
+
+// Each libcall is handled by the function named after it with _libcall
+// appended.  One whose libcall.def entry lists a result and arguments takes
+// and returns plain values, and marshal generates the code that fetches
+// them, stores the result and returns to the guest.  A custom one does all
+// of that itself.
+struct custom;
+template<typename Result, typename Arguments> struct marshal;
+template<typename Result, typename... Arguments> struct marshal<Result, void(Arguments...)> {
+    template<auto Handler> static bool handle() {
+        Result::set(Handler(Arguments::get()...));
+        return ret();
+    }
+};
+template<> struct marshal<custom, void()> {
+    template<bool (*Handler)()> static bool handle() { return Handler(); }
+};
+
+bool exit_libcall() { return false; }
+u24 putchar_libcall(char c) { return put(c); }
+bool puts_libcall() {
+    u32 len;
+    auto *str = string_span(memref<u24>(r.SPL + 3), len);
+    if (!str)
+        return fail("puts");
+    shadow_use(memref<u24>(r.SPL + 3), len);
+    put(str, len);
+    put('\n');
+    return ret(u24{});
+}
+bool putbuf_libcall() {
+    u24 buf = memref<u24>(r.SPL + 3);
+    u24 len = memref<u24>(r.SPL + 6);
+    if (!len)
+        return ret();
+    auto *pbuf = span(buf, len);
+    if (!pbuf)
+        return fail("putbuf");
+    shadow_use(buf, len);
+    put(reinterpret_cast<const char *>(pbuf), len);
+    return ret();
+}
+bool memcpy_libcall() {
+    u24 dst = memref<u24>(r.SPL + 3);
+    u24 src = memref<u24>(r.SPL + 6);
+    u24 len = memref<u24>(r.SPL + 9);
+    u8 *pdst = span(dst, len), *psrc = span(src, len);
+    if (!pdst || !psrc)
+        return fail("memcpy");
+    std::memcpy(pdst, psrc, len);
+    shadow_move(dst, src, len);
+    code_written(dst, len);
+    return ret(dst);
+}
+bool memset_libcall() {
+    u24 dst = memref<u24>(r.SPL + 3);
+    u24 src = memref<u24>(r.SPL + 6);
+    u24 len = memref<u24>(r.SPL + 9);
+    u8 *pdst = span(dst, len);
+    if (!pdst)
+        return fail("memset");
+    std::memset(pdst, src, len);
+    shadow_set(dst, len, shadow::defined);
+    code_written(dst, len);
+    return ret(dst);
+}
+bool strcmp_libcall() {
+    u32 lhs_len, rhs_len;
+    auto *lhs = string_span(memref<u24>(r.SPL + 3), lhs_len);
+    auto *rhs = string_span(memref<u24>(r.SPL + 6), rhs_len);
+    if (!lhs || !rhs)
+        return fail("strcmp");
+    shadow_use(memref<u24>(r.SPL + 3), lhs_len + 1);
+    shadow_use(memref<u24>(r.SPL + 6), rhs_len + 1);
+    int result = std::memcmp(lhs, rhs, std::min(lhs_len, rhs_len) + 1);
+    return ret(u24(result < 0 ? -1 : result > 0 ? 1 : 0));
+}
+u32 crc32_update_libcall(u32 crc, u64 value) { return crc32_update(crc, value); }
+bool heap_init_libcall() {
+    reset_heap();
+    if (r.HL >= ram_start && r.HL <= stack_bottom) {
+        guest.heap.start = guest.heap.top = r.HL;
+        shadow_set(guest.heap.start, stack_bottom - guest.heap.start, shadow::unmapped);
+    }
+    return ret();
+}
+u24 malloc_libcall(u24 size) { return heap_alloc(size); }
+bool calloc_libcall() {
+    u64 size = u64(u32(memref<u24>(r.SPL + 3))) * u32(memref<u24>(r.SPL + 6));
+    u32 address = size <= 0xFFFFFF ? heap_alloc(size) : 0;
+    if (address) {
+        std::memset(&ram[address - ram_start], 0, size);
+        shadow_set(address, size, shadow::defined);
+    }
+    return ret(u24(address));
+}
+bool free_libcall() {
+    u24 address = memref<u24>(r.SPL + 3);
+    if (address && !heap_free(address))
+        return fail("free");
+    return ret();
+}
+bool realloc_libcall() {
+    u24 address = memref<u24>(r.SPL + 3), size = memref<u24>(r.SPL + 6);
+    if (!address)
+        return ret(u24(heap_alloc(size)));
+    auto live = guest.heap.live.find(address);
+    if (live == guest.heap.live.end()) {
+        std::fprintf(stderr, "Realloc of unallocated pointer %06X\n", u32(address));
+        return fail("realloc");
+    }
+    if (redzone && !fence_intact(address, live->second))
+        return fail("realloc");
+    if (size + 2 * redzone <= u32(1) << live->second.order) {
+        u32 old_size = std::exchange(live->second.size, size);
+        if (size > old_size)
+            shadow_set(address + old_size, size - old_size, shadow::undefined);
+        else
+            shadow_set(address + size, old_size - size, shadow::unmapped);
+        if (redzone)
+            fence(address, live->second);
+        return ret(address);
+    }
+    u32 moved = heap_alloc(size);
+    if (moved) {
+        u32 length = std::min<u32>(size, guest.heap.live[address].size);
+        std::memcpy(&ram[moved - ram_start], &ram[address - ram_start], length);
+        shadow_move(moved, address, length);
+        heap_free(address);
+    }
+    return ret(u24(moved));
+}
+bool _dump_libcall() {
+    fprintf(stderr, "AF %04X     %04X AF'\nBC %06X %06X BC'\nDE %06X %06X DE'\n"
+            "HL %06X %06X HL'\nIX %06X %06X SPS\nIY %06X %06X SPL\n\n",
+            r.AF, r._AF, r.BC, r._BC, r.DE, r._DE,
+            r.HL, r._HL, r.IX, r.SPS, r.IY, r.SPL);
+    return ret();
+}
+bool _frameset0_libcall() {
+    ret();
+    memref<u24>(r.SPL -= 3) = r.IX;
+    shadow_set(r.SPL, 3, shadow::defined);
+    r.IX = r.SPL;
+    return true;
+}
+bool _frameset_libcall() {
+    ret();
+    memref<u24>(r.SPL -= 3) = r.IX;
+    shadow_set(r.SPL, 3, shadow::defined);
+    r.IX = r.SPL;
+    r.SPL += s24(r.HL);
+    if (r.SPL < r.IX)
+        shadow_set(r.SPL, r.IX - r.SPL, shadow::undefined);
+    return true;
+}
+u24 _stoiu_libcall(u16 x) { return x; }
+u24 _stoi_libcall(u16 x) { return s16(x); }
+u32 _itol_libcall(u32 x) { return s32(s24(x)); }
+u16 _snot_libcall(u16 x) { return ~x; }
+u24 _inot_libcall(u32 x) { return ~x; }
+u32 _lnot_libcall(u32 x) { return ~x; }
+u64 _llnot_libcall(u64 x) { return ~x; }
+u16 _sand_libcall(u16 x, u16 y) { return x & y; }
+u24 _iand_libcall(u32 x, u32 y) { return x & y; }
+u32 _land_libcall(u32 x, u32 y) { return x & y; }
+u64 _lland_libcall(u64 x, u64 y) { return x & y; }
+u16 _sor_libcall(u16 x, u16 y) { return x | y; }
+u24 _ior_libcall(u32 x, u32 y) { return x | y; }
+u32 _lor_libcall(u32 x, u32 y) { return x | y; }
+u64 _llor_libcall(u64 x, u64 y) { return x | y; }
+u16 _sxor_libcall(u16 x, u16 y) { return x ^ y; }
+u24 _ixor_libcall(u32 x, u32 y) { return x ^ y; }
+u32 _lxor_libcall(u32 x, u32 y) { return x ^ y; }
+u64 _llxor_libcall(u64 x, u64 y) { return x ^ y; }
+u8 _bshl_libcall(u8 x, u8 n) { return x << n; }
+u16 _sshl_libcall(u16 x, u8 n) { return u32(x) << n; }
+u16 _sshl_b_libcall(u16 x, u8 n) { return u32(x) << n; }
+u24 _ishl_libcall(u32 x, u8 n) { return x << n; }
+u24 _ishl_b_libcall(u32 x, u8 n) { return x << n; }
+u32 _lshl_libcall(u32 x, u8 n) { return x << n; }
+u64 _llshl_libcall(u64 x, u8 n) { return x << n; }
+u8 _bshrs_libcall(u8 x, u8 n) { return s8(x) >> n; }
+u16 _sshrs_libcall(u16 x, u8 n) { return s16(x) >> n; }
+u16 _sshrs_b_libcall(u16 x, u8 n) { return s16(x) >> n; }
+u24 _ishrs_libcall(u32 x, u8 n) { return s24(x) >> n; }
+u24 _ishrs_b_libcall(u32 x, u8 n) { return s24(x) >> n; }
+u32 _lshrs_libcall(u32 x, u8 n) { return s32(x) >> n; }
+u64 _llshrs_libcall(u64 x, u8 n) { return s64(x) >> n; }
+u8 _bshru_libcall(u8 x, u8 n) { return x >> n; }
+u16 _sshru_libcall(u16 x, u8 n) { return x >> n; }
+u16 _sshru_b_libcall(u16 x, u8 n) { return x >> n; }
+u24 _ishru_libcall(u32 x, u8 n) { return x >> n; }
+u24 _ishru_b_libcall(u32 x, u8 n) { return x >> n; }
+u32 _lshru_libcall(u32 x, u8 n) { return x >> n; }
+u64 _llshru_libcall(u64 x, u8 n) { return x >> n; }
+u8 _lcmpu_libcall(u32 x, u32 y) { return cmp(x, y); }
+u8 _llcmpu_libcall(u64 x, u64 y) { return cmp(x, y); }
+u8 _scmpzero_libcall(u16 x) { return cmp(x); }
+u8 _icmpzero_libcall(u32 x) { return cmp(u32(x << 8)); }
+u8 _lcmpzero_libcall(u32 x) { return cmp(x); }
+u8 _llcmpzero_libcall(u64 x) { return cmp(x); }
+u8 _setflag_libcall(u8 f) { return f ^ (f << 5 & 1 << 7); }
+u16 _sneg_libcall(u16 x) { return -x; }
+u24 _ineg_libcall(u32 x) { return -x; }
+u32 _lneg_libcall(u32 x) { return -x; }
+u64 _llneg_libcall(u64 x) { return -x; }
+u32 _ladd_libcall(u32 x, u32 y) { return x + y; }
+u32 _ladd_b_libcall(u32 x, u8 y) { return x + y; }
+u64 _lladd_libcall(u64 x, u64 y) { return x + y; }
+u32 _lsub_libcall(u32 x, u32 y) { return x - y; }
+u64 _llsub_libcall(u64 x, u64 y) { return x - y; }
+u8 _bmulu_libcall(u8 x, u8 y) { return x * y; }
+u16 _smulu_libcall(u16 x, u16 y) { return x * y; }
+u24 _imulu_libcall(u32 x, u32 y) { return x * y; }
+u24 _imul_b_libcall(u32 x, u8 y) { return x * y; }
+u32 _lmulu_libcall(u32 x, u32 y) { return x * y; }
+u64 _llmulu_libcall(u64 x, u64 y) { return x * y; }
+u8 _bdivs_libcall(u8 x, u8 y) { return div(s8(x), s8(y)); }
+u16 _sdivs_libcall(u16 x, u16 y) { return div(s16(x), s16(y)); }
+u24 _idivs_libcall(u32 x, u32 y) { return u24(div(s24(x), s24(y))); }
+u32 _ldivs_libcall(u32 x, u32 y) { return div(s32(x), s32(y)); }
+u64 _lldivs_libcall(u64 x, u64 y) { return div(s64(x), s64(y)); }
+u8 _bdivu_libcall(u8 x, u8 y) { return div(x, y); }
+u16 _sdivu_libcall(u16 x, u16 y) { return div(x, y); }
+u24 _idivu_libcall(u32 x, u32 y) { return div(x, y); }
+u32 _ldivu_libcall(u32 x, u32 y) { return div(x, y); }
+u64 _lldivu_libcall(u64 x, u64 y) { return div(x, y); }
+u8 _brems_libcall(u8 x, u8 y) { return rem(s8(x), s8(y)); }
+u16 _srems_libcall(u16 x, u16 y) { return rem(s16(x), s16(y)); }
+u24 _irems_libcall(u32 x, u32 y) { return u24(rem(s24(x), s24(y))); }
+u32 _lrems_libcall(u32 x, u32 y) { return rem(s32(x), s32(y)); }
+u64 _llrems_libcall(u64 x, u64 y) { return rem(s64(x), s64(y)); }
+u8 _bremu_libcall(u8 x, u8 y) { return rem(x, y); }
+u16 _sremu_libcall(u16 x, u16 y) { return rem(x, y); }
+u24 _iremu_libcall(u32 x, u32 y) { return rem(u24(x), u24(y)); }
+u32 _lremu_libcall(u32 x, u32 y) { return rem(x, y); }
+u64 _llremu_libcall(u64 x, u64 y) { return rem(x, y); }
+bool _idvrmu_libcall() {
+    u24 dividend = r.HL, divisor = r.BC;
+    r.DE = div(u32(dividend), u32(divisor)) & 0xFFFFFF;
+    return ret(u24(rem(u32(dividend), u32(divisor))));
+}
+bool _ldvrmu_libcall() {
+    u32 dividend = regs(r.E, r.HL), divisor = regs(r.A, r.BC);
+    regs(r.A, r.BC) = div(dividend, divisor);
+    return ret(rem(dividend, divisor));
+}
+u8 _bpopcnt_libcall(u8 x) { return __builtin_popcount(x); }
+u8 _spopcnt_libcall(u16 x) { return __builtin_popcount(x); }
+u8 _ipopcnt_libcall(u32 x) { return __builtin_popcount(x & 0xFFFFFF); }
+u8 _lpopcnt_libcall(u32 x) { return __builtin_popcount(x); }
+u8 _llpopcnt_libcall(u64 x) { return __builtin_popcountll(x); }
+float _fadd_libcall(float x, float y) { return x + y; }
+float _fsub_libcall(float x, float y) { return x - y; }
+float _fmul_libcall(float x, float y) { return x * y; }
+float _fdiv_libcall(float x, float y) { return x / y; }
+float _frem_libcall(float x, float y) { return std::fmod(x, y); }
+float _fneg_libcall(float x) { return -x; }
+u8 _fcmp_libcall(float x, float y) { return fcmp(x, y); }
+u32 _ftol_libcall(float x) { return s32(x); }
+float _ltof_libcall(u32 x) { return float(s32(x)); }
+float _ultof_libcall(u32 x) { return float(x); }
+double _dadd_libcall(double x, double y) { return x + y; }
+double _dsub_libcall(double x, double y) { return x - y; }
+double _dmul_libcall(double x, double y) { return x * y; }
+double _ddiv_libcall(double x, double y) { return x / y; }
+double _drem_libcall(double x, double y) { return std::fmod(x, y); }
+double _dneg_libcall(double x) { return -x; }
+u8 _dcmp_libcall(double x, double y) { return fcmp(x, y); }
+double _ftod_libcall(float x) { return double(x); }
+float _dtof_libcall(double x) { return float(x); }
+u32 _dtol_libcall(double x) { return s32(x); }
+u32 _dtoul_libcall(double x) { return u32(x); }
+double _ltod_libcall(u32 x) { return double(s32(x)); }
+double _ultod_libcall(u32 x) { return double(x); }
+u64 _dtoll_libcall(double x) { return s64(x); }
+double _lltod_libcall(u64 x) { return double(s64(x)); }
+double _ulltod_libcall(u64 x) { return double(x); }
+
+struct libcall_handler {
+    const char *name;
+    bool (*handle)();
+};
+constexpr libcall_handler libcall_handlers[] = {
+#define LIBCALL(name, abi, result, ...) {#name, marshal<result, void(__VA_ARGS__)>::handle<name##_libcall>},
+#include "libcall.def"
+#undef LIBCALL
+};
+
+static_assert(std::size(libcall_handlers) < 0x100, "libcall_index holds one byte per address");
+
+// Handler indices in name order, for resolve_libcalls to search.
+constexpr auto libcall_order = [] {
+    std::array<u8, std::size(libcall_handlers)> order{};
+    for (size index = 0; index != order.size(); ++index) {
+        size at = index;
+        for (; at && std::string_view(libcall_handlers[order[at - 1]].name) > libcall_handlers[index].name; --at)
+            order[at] = order[at - 1];
+        order[at] = index;
+    }
+    return order;
+}();
+static_assert([] {
+    for (size at = 1; at != libcall_order.size(); ++at)
+        if (std::string_view(libcall_handlers[libcall_order[at - 1]].name) == libcall_handlers[libcall_order[at]].name)
+            return false;
+    return true;
+}(), "libcall.def names a libcall twice");
+
+void resolve_libcalls(void) {
+    guest.libcall_index.assign(ram_size, 0);
+    auto before = [](u8 index, const char *name) { return std::strcmp(libcall_handlers[index].name, name) < 0; };
+    for (u32 offset = 1; offset != ram_size; ++offset) {
+        if (ram[offset - 1] != halt_opcode)
+            continue;
+        auto *name = reinterpret_cast<const char *>(&ram[offset]);
+        if (!std::memchr(name, '\0', ram_size - offset))
+            break;
+        auto found = std::lower_bound(libcall_order.begin(), libcall_order.end(), name, before);
+        if (found != libcall_order.end() && !std::strcmp(libcall_handlers[*found].name, name))
+            guest.libcall_index[offset] = *found + 1;
+    }
+}
+
+// Whether pc holds a libcall name, even one with no handler.
+bool stub_name(u32 pc) {
+    for (u32 offset = pc - ram_start, end = offset + 25; offset < end && offset < ram_size; ++offset) {
+        char c = ram[offset];
+        if (!c)
+            return offset != pc - ram_start;
+        if (c != '_' && !std::isalnum(static_cast<unsigned char>(c)))
+            return false;
+    }
+    return false;
+}
 
 bool emulate_libcall(void) {
+    if (u32 offset = r.PC - ram_start; offset < guest.libcall_index.size())
+        if (auto index = guest.libcall_index[offset])
+            return libcall_handlers[index - 1].handle();
+    if (!cpu.IEF1 && !stub_name(r.PC)) {
+        guest.hang_reason = "halt with interrupts disabled";
+        return false;
+    }
     std::string name(memref<char[25]>(r.PC));
     //std::fprintf(stderr, "libcall: %10s(0x%08X, 0x%08X)\n", name.c_str(), u32(regs(r.E, r.HL)), u32(regs(r.A, r.BC)));
-    if (auto handler = libcall_handlers.find(name); handler != libcall_handlers.end())
-        return handler->second();
     std::fprintf(stderr, "Unimplemented libcall: %s\n", name.c_str());
     r.HL = -1;
     return false;
 }
+
+// Block translation engine, selected with --blocks.  Straight-line runs of
+// guest code in ram are decoded once into insn records whose exec functions
+// run the instruction directly against cpu.registers and return false once
+// control leaves the block.  Anything the decoder does not understand, and
+// any code outside ram or outside ADL mode, is single-stepped by CEmu.
+namespace flag {
+constexpr u8 c = 1 << 0, n = 1 << 1, pv = 1 << 2, h = 1 << 4, z = 1 << 6, s = 1 << 7;
+constexpr u8 undef = 1 << 3 | 1 << 5;
+}
+constexpr u32 mask24 = 0xFFFFFF;
+// Estimated cost of every byte fetched, read or written, standing in for
+// CEmu's per-access wait states so that the cycle deadline keeps its meaning.
+constexpr u32 access_cycles = 3;
+constexpr size max_block_insns = 32;
+
+bool use_blocks, fast_mode;
+// Run budgets: guest cycles normally, retired instructions with --fast.
+u64 cycle_limit = 48000000 * 10, instruction_limit = 100000000;
+u32 zero;
+
+// Execution trace for --trace=FILE: a ring of the last trace_size block
+// entries, stepped instructions, taken branches, libcalls, writes and block
+// copies, dumped to FILE when a run ends abnormally and decoded with
+// --decode-trace=FILE.  In the block engine recording is a store into the
+// ring and leaves the run itself alone, so it is cheap enough to leave on.
+// The interpreter has to single-step to be traced, which makes it much
+// slower, and its writes are found by comparing bytes, so stores of an
+// unchanged value are missing.  Entries are a u32 of kind << 24 | address
+// and a u32 value, little endian, oldest first after a "RZTRACE1" magic and
+// a u32 count.
+enum class trace_kind : u8 { block, step, branch, libcall, write, copy };
+constexpr const char *trace_names[] = {"block", "step", "branch", "libcall", "write", "copy"};
+constexpr u32 trace_size = 1 << 16;
+constexpr char trace_magic[8] = {'R', 'Z', 'T', 'R', 'A', 'C', 'E', '1'};
+const char *trace_path;
+
+void trace(trace_kind kind, u32 address, u32 value) {
+    if (!guest.trace_ring.empty())
+        guest.trace_ring[guest.trace_head++ & (trace_size - 1)] = {u32(kind) << 24 | (address & 0xFFFFFF), value};
+}
+
+void code_written(u32 address, u32 length) {
+    if (guest.code_map.empty())
+        return;
+    for (u32 offset = address - ram_start, end = offset + length; offset < end && offset < ram_size; ++offset)
+        if (guest.code_map[offset])
+            guest.code_dirty = true;
+}
+
+// Copies pass Check = false and move the shadow state themselves.
+template<bool Check = true> u8 read8(u32 address) {
+    if (u32 offset = (address & mask24) - ram_start; offset < ram_size) {
+        if (Check && shadow_enabled)
+            shadow_read(offset);
+        return ram[offset];
+    }
+    guest.side_effects = true;
+    return mem_read_cpu(address & mask24, false);
+}
+u32 read24(u32 address) {
+    if (u32 offset = (address & mask24) - ram_start; offset < ram_size - 2) {
+        if (shadow_enabled)
+            shadow_read(offset);
+        return ram[offset] | ram[offset + 1] << 8 | ram[offset + 2] << 16;
+    }
+    return read8(address) | read8<false>(address + 1) << 8 | read8<false>(address + 2) << 16;
+}
+// Returns false when the write lands on translated code, ending the block.
+bool write8(u32 address, u8 value) {
+    guest.side_effects = true;
+    trace(trace_kind::write, address, value);
+    if (u32 offset = (address & mask24) - ram_start; offset < ram_size) {
+        if (shadow_enabled)
+            shadow_write(offset);
+        ram[offset] = value;
+        if (guest.code_map[offset])
+            return guest.code_dirty = true, false;
+        return true;
+    }
+    mem_write_cpu(address & mask24, value);
+    return true;
+}
+bool write24(u32 address, u32 value) {
+    return write8(address, value) & write8(address + 1, value >> 8) & write8(address + 2, value >> 16);
+}
+bool push24(u32 value) {
+    r.SPL = (r.SPL - 3) & mask24;
+    return write24(r.SPL, value);
+}
+u32 pop24(void) {
+    u32 value = read24(r.SPL);
+    r.SPL = (r.SPL + 3) & mask24;
+    return value;
+}
+
+u8 flags_sz(u8 value) {
+    return (value & flag::s) | (value ? 0 : flag::z);
+}
+u8 flags_szp(u8 value) {
+    return flags_sz(value) | (__builtin_parity(value) ? 0 : flag::pv);
+}
+u8 add8(u8 x, u8 y, bool carry) {
+    unsigned result = x + y + carry;
+    r.F = (r.F & flag::undef) | flags_sz(result) | ((x ^ y ^ result) & flag::h) |
+        ((~(x ^ y) & (x ^ result)) >> 5 & flag::pv) | (result >> 8 & flag::c);
+    return result;
+}
+u8 sub8(u8 x, u8 y, bool carry) {
+    unsigned result = x - y - carry;
+    r.F = (r.F & flag::undef) | flags_sz(result) | ((x ^ y ^ result) & flag::h) |
+        (((x ^ y) & (x ^ result)) >> 5 & flag::pv) | flag::n | (result >> 8 & flag::c);
+    return result;
+}
+u32 add24(u32 x, u32 y) {
+    u32 result = x + y;
+    r.F = (r.F & (flag::s | flag::z | flag::pv | flag::undef)) |
+        (((x & 0xFFF) + (y & 0xFFF)) >> 8 & flag::h) | (result >> 24 & flag::c);
+    return result & mask24;
+}
+u32 adc24(u32 x, u32 y, bool carry) {
+    u32 result = x + y + carry;
+    r.F = (r.F & flag::undef) | (result >> 16 & flag::s) | (result & mask24 ? 0 : flag::z) |
+        (((x & 0xFFF) + (y & 0xFFF) + carry) >> 8 & flag::h) |
+        ((~(x ^ y) & (x ^ result)) >> 21 & flag::pv) | (result >> 24 & flag::c);
+    return result & mask24;
+}
+u32 sbc24(u32 x, u32 y, bool carry) {
+    u32 result = x - y - carry;
+    r.F = (r.F & flag::undef) | (result >> 16 & flag::s) | (result & mask24 ? 0 : flag::z) |
+        (((x & 0xFFF) - (y & 0xFFF) - carry) >> 8 & flag::h) |
+        (((x ^ y) & (x ^ result)) >> 21 & flag::pv) | flag::n | (result >> 24 & flag::c);
+    return result & mask24;
+}
+
+// Operand kinds: a register, memory at *base + n, or the immediate m.
+enum kind { reg, mem, imm };
+template<kind Kind> u8 load(const insn &i) {
+    if constexpr (Kind == reg)
+        return *i.y;
+    else if constexpr (Kind == mem)
+        return read8(*i.yy + i.n);
+    else
+        return i.m;
+}
+bool stop(const insn &i) {
+    r.PC = i.next;
+    return false;
+}
+template<kind Kind> bool store(const insn &i, u8 value) {
+    if constexpr (Kind == reg)
+        return *i.x = value, true;
+    else
+        return write8(*i.yy + i.n, value) || stop(i);
+}
+
+enum class alu { add, adc, sub, sbc, and_, xor_, or_, cp, tst };
+template<alu Op, kind Kind> bool exec_alu(const insn &i) {
+    u8 x = r.A, y = load<Kind>(i);
+    switch (Op) {
+        case alu::add: r.A = add8(x, y, false); break;
+        case alu::adc: r.A = add8(x, y, r.F & flag::c); break;
+        case alu::sub: r.A = sub8(x, y, false); break;
+        case alu::sbc: r.A = sub8(x, y, r.F & flag::c); break;
+        case alu::and_: r.F = (r.F & flag::undef) | flags_szp(r.A = x & y) | flag::h; break;
+        case alu::xor_: r.F = (r.F & flag::undef) | flags_szp(r.A = x ^ y); break;
+        case alu::or_: r.F = (r.F & flag::undef) | flags_szp(r.A = x | y); break;
+        case alu::cp: sub8(x, y, false); break;
+        case alu::tst: r.F = (r.F & flag::undef) | flags_szp(x & y) | flag::h; break;
+    }
+    return true;
+}
+template<kind Dst, kind Src> bool exec_ld(const insn &i) {
+    return store<Dst>(i, load<Src>(i));
+}
+template<kind Kind> bool exec_inc(const insn &i) {
+    u8 result = load<Kind>(i) + 1;
+    r.F = (r.F & (flag::c | flag::undef)) | flags_sz(result) | (result & 0xF ? 0 : flag::h) |
+        (result == 0x80 ? flag::pv : 0);
+    return store<Kind>(i, result);
+}
+template<kind Kind> bool exec_dec(const insn &i) {
+    u8 result = load<Kind>(i) - 1;
+    r.F = (r.F & (flag::c | flag::undef)) | flags_sz(result) | ((result & 0xF) == 0xF ? flag::h : 0) |
+        (result == 0x7F ? flag::pv : 0) | flag::n;
+    return store<Kind>(i, result);
+}
+// Rotates and shifts from the CB page; Op is the y field of the opcode.
+template<unsigned Op> u8 shift(u8 x, u8 &carry) {
+    u8 in = r.F & flag::c;
+    carry = Op & 1 ? x & 1 : x >> 7;
+    if constexpr (Op == 0)
+        return x << 1 | carry;
+    else if constexpr (Op == 1)
+        return x >> 1 | carry << 7;
+    else if constexpr (Op == 2)
+        return x << 1 | in;
+    else if constexpr (Op == 3)
+        return x >> 1 | in << 7;
+    else if constexpr (Op == 4)
+        return x << 1;
+    else if constexpr (Op == 5)
+        return x >> 1 | (x & 0x80);
+    else
+        return x >> 1;
+}
+template<unsigned Op, kind Kind> bool exec_shift(const insn &i) {
+    u8 carry, result = shift<Op>(load<Kind>(i), carry);
+    r.F = (r.F & flag::undef) | flags_szp(result) | carry;
+    return store<Kind>(i, result);
+}
+template<unsigned Op> bool exec_shift_a(const insn &) {
+    u8 carry;
+    r.A = shift<Op>(r.A, carry);
+    r.F = (r.F & (flag::s | flag::z | flag::pv | flag::undef)) | carry;
+    return true;
+}
+template<kind Kind> bool exec_bit(const insn &i) {
+    u8 result = load<Kind>(i) & i.m;
+    r.F = (r.F & (flag::c | flag::undef)) | flags_szp(result) | flag::h;
+    return true;
+}
+template<kind Kind> bool exec_res(const insn &i) {
+    return store<Kind>(i, load<Kind>(i) & ~i.m);
+}
+template<kind Kind> bool exec_set(const insn &i) {
+    return store<Kind>(i, load<Kind>(i) | i.m);
+}
+bool exec_cpl(const insn &) {
+    r.A = ~r.A;
+    r.F |= flag::h | flag::n;
+    return true;
+}
+bool exec_neg(const insn &) {
+    r.A = sub8(0, r.A, false);
+    return true;
+}
+bool exec_scf(const insn &) {
+    r.F = (r.F & (flag::s | flag::z | flag::pv | flag::undef)) | flag::c;
+    return true;
+}
+bool exec_ccf(const insn &) {
+    r.F = (r.F & (flag::s | flag::z | flag::pv | flag::undef)) | (r.F & flag::c) << 4 | (~r.F & flag::c);
+    return true;
+}
+bool exec_rld(const insn &i) {
+    u8 x = read8(r.HL);
+    bool ok = write8(r.HL, x << 4 | (r.A & 0xF));
+    r.A = (r.A & 0xF0) | x >> 4;
+    r.F = (r.F & (flag::c | flag::undef)) | flags_szp(r.A);
+    return ok || stop(i);
+}
+bool exec_rrd(const insn &i) {
+    u8 x = read8(r.HL);
+    bool ok = write8(r.HL, r.A << 4 | x >> 4);
+    r.A = (r.A & 0xF0) | (x & 0xF);
+    r.F = (r.F & (flag::c | flag::undef)) | flags_szp(r.A);
+    return ok || stop(i);
+}
+
+bool exec_nop(const insn &) {
+    return true;
+}
+bool exec_lea(const insn &i) {
+    *i.xx = (*i.yy + i.n) & mask24;
+    return true;
+}
+bool exec_ld24_load(const insn &i) {
+    *i.xx = read24(*i.yy + i.n);
+    return true;
+}
+bool exec_ld24_store(const insn &i) {
+    return write24(*i.yy + i.n, *i.xx) || stop(i);
+}
+bool exec_push(const insn &i) {
+    return push24((*i.yy + i.n) & mask24) || stop(i);
+}
+bool exec_pop(const insn &i) {
+    *i.xx = pop24();
+    return true;
+}
+bool exec_push_af(const insn &i) {
+    return push24(r.AF) || stop(i);
+}
+bool exec_pop_af(const insn &) {
+    r.AF = pop24();
+    return true;
+}
+bool exec_add24(const insn &i) {
+    *i.xx = add24(*i.xx, *i.yy);
+    return true;
+}
+bool exec_adc24(const insn &i) {
+    *i.xx = adc24(*i.xx, *i.yy, r.F & flag::c);
+    return true;
+}
+bool exec_sbc24(const insn &i) {
+    *i.xx = sbc24(*i.xx, *i.yy, r.F & flag::c);
+    return true;
+}
+bool exec_mlt(const insn &i) {
+    *i.xx = (*i.xx & 0xFF) * (*i.xx >> 8 & 0xFF);
+    return true;
+}
+bool exec_ex_af(const insn &) {
+    std::swap(r.AF, r._AF);
+    return true;
+}
+bool exec_exx(const insn &) {
+    std::swap(r.BC, r._BC);
+    std::swap(r.DE, r._DE);
+    std::swap(r.HL, r._HL);
+    return true;
+}
+bool exec_ex_de_hl(const insn &) {
+    std::swap(r.DE, r.HL);
+    return true;
+}
+bool exec_ex_sp(const insn &i) {
+    u32 value = read24(r.SPL);
+    bool ok = write24(r.SPL, *i.xx);
+    *i.xx = value;
+    return ok || stop(i);
+}
+
+// Repeated transfers and searches wholly inside ram run on the host in one
+// go, with the same registers, flags and cycles as the byte-by-byte loop
+// below.  Anything else falls back to that loop: ranges reaching outside
+// ram and destinations covering translated code (including the instruction
+// itself).  A trace gets one copy entry instead of a write per byte.
+bool code_in(u32 offset, u32 length) {
+    // The interpreter translates nothing, leaving just the instruction itself.
+    if (guest.code_map.empty())
+        return r.PC - ram_start - offset < length || r.PC + 1 - ram_start - offset < length;
+    return std::any_of(&guest.code_map[offset], &guest.code_map[offset] + length, [](u8 code) { return code; });
+}
+// Charges the bytes a transfer or search went through, except in fast mode,
+// which leaves cycles alone like run_blocks<true>.
+void charge(u64 cycles) {
+    if (!fast_mode)
+        cpu.cycles += cycles;
+}
+// Offset of the length bytes a Step-wise run from address covers, or
+// ram_size when they are not all in ram.
+template<int Step> u32 ram_range(u32 address, u32 length) {
+    u32 offset = (Step > 0 ? address : address - (length - 1)) - ram_start;
+    return offset < ram_size && length <= ram_size - offset ? offset : ram_size;
+}
+// Copying one byte at a time, a destination that starts inside the source
+// keeps repeating the bytes in between; copying in chunks no longer than
+// that distance does the same.
+template<int Step> bool ld_block_fast(void) {
+    u32 count = r.BC;
+    if (!count)
+        return false;
+    u32 src = ram_range<Step>(r.HL, count), dst = ram_range<Step>(r.DE, count);
+    if (src == ram_size || dst == ram_size || code_in(dst, count))
+        return false;
+    auto unmapped = [&](u32 offset) {
+        return std::count(&guest.shadow_map[offset], &guest.shadow_map[offset] + count, shadow::unmapped);
+    };
+    if (shadow_enabled && (unmapped(src) || unmapped(dst)))
+        return false;
+    auto copy = [&](u8 *base) {
+        u8 *from = base + src, *to = base + dst;
+        u32 distance = Step > 0 ? dst - src : src - dst;
+        if (distance && distance < count)
+            for (u32 done = 0, chunk; done != count; done += chunk) {
+                chunk = std::min(count - done, distance);
+                u32 at = Step > 0 ? done : count - done - chunk;
+                std::memcpy(to + at, from + at, chunk);
+            }
+        else
+            std::memmove(to, from, count);
+    };
+    copy(ram);
+    if (shadow_enabled)
+        copy(guest.shadow_map.data());
+    trace(trace_kind::copy, ram_start + dst, count);
+    r.HL = (r.HL + Step * count) & mask24;
+    r.DE = (r.DE + Step * count) & mask24;
+    r.BC = 0;
+    charge(2 * access_cycles * count);
+    guest.side_effects = true;
+    return true;
+}
+template<int Step> bool cp_block_fast(u8 &x) {
+    u32 count = r.BC, offset = ram_range<Step>(r.HL, count), n;
+    if (!count || offset == ram_size || shadow_enabled)
+        return false;
+    const u8 *p = &ram[offset];
+    if constexpr (Step > 0) {
+        auto *found = static_cast<const u8 *>(std::memchr(p, r.A, count));
+        n = found ? found - p + 1 : count;
+        x = p[n - 1];
+    } else {
+        for (n = 1; n != count && p[count - n] != r.A; ++n) {}
+        x = p[count - n];
+    }
+    r.HL = (r.HL + Step * n) & mask24;
+    r.BC = (r.BC - n) & mask24;
+    charge(access_cycles * n);
+    return true;
+}
+
+void ld_block_flags(void) {
+    r.F = (r.F & (flag::s | flag::z | flag::c | flag::undef)) | (r.BC ? flag::pv : 0);
+}
+void cp_block_flags(u8 x, u8 result) {
+    r.F = (r.F & (flag::c | flag::undef)) | flags_sz(result) | ((r.A ^ x ^ result) & flag::h) |
+        (r.BC ? flag::pv : 0) | flag::n;
+}
+
+// Block transfers and searches; Step is +1 or -1 and Repeat selects the
+// *IR/*DR forms, which resume at their own address after a code write.
+template<int Step, bool Repeat> bool exec_ld_block(const insn &i) {
+    bool ok = true;
+    if (!Repeat || !ld_block_fast<Step>())
+        do {
+            ok = write8(r.DE, read8<false>(r.HL));
+            if (shadow_enabled)
+                if (u32 to = r.DE - ram_start, from = r.HL - ram_start; to < ram_size && from < ram_size) {
+                    u8 state = shadow_carry(from);
+                    if (guest.shadow_map[to] != shadow::unmapped)
+                        guest.shadow_map[to] = state;
+                }
+            r.HL = (r.HL + Step) & mask24;
+            r.DE = (r.DE + Step) & mask24;
+            r.BC = (r.BC - 1) & mask24;
+            charge(2 * access_cycles);
+        } while (Repeat && r.BC && ok);
+    ld_block_flags();
+    if (Repeat && r.BC)
+        return r.PC = i.pc, false;
+    return ok || stop(i);
+}
+template<int Step, bool Repeat> bool exec_cp_block(const insn &) {
+    u8 x, result;
+    if (Repeat && cp_block_fast<Step>(x))
+        result = r.A - x;
+    else
+        do {
+            x = read8(r.HL);
+            result = r.A - x;
+            r.HL = (r.HL + Step) & mask24;
+            r.BC = (r.BC - 1) & mask24;
+            charge(access_cycles);
+        } while (Repeat && r.BC && result);
+    cp_block_flags(x, result);
+    return true;
+}
+
+// Conditions are numbered as in the cc field of the opcode; 8 means always.
+template<unsigned Cond> bool test(void) {
+    if constexpr (Cond == 8)
+        return true;
+    constexpr u8 flags[] = { flag::z, flag::c, flag::pv, flag::s };
+    return bool(r.F & flags[Cond >> 1]) == bool(Cond & 1);
+}
+template<unsigned Cond> bool exec_jp(const insn &i) {
+    r.PC = test<Cond>() ? i.n : i.next;
+    return false;
+}
+bool exec_jp_ind(const insn &i) {
+    r.PC = *i.yy & mask24;
+    return false;
+}
+bool exec_djnz(const insn &i) {
+    r.PC = --r.B ? i.n : i.next;
+    return false;
+}
+template<unsigned Cond> bool exec_call(const insn &i) {
+    r.PC = i.next;
+    if (test<Cond>()) {
+        push24(i.next);
+        r.PC = i.n;
+    }
+    return false;
+}
+template<unsigned Cond> bool exec_ret(const insn &i) {
+    r.PC = test<Cond>() ? pop24() : i.next;
+    return false;
+}
+// A jump to itself: once taken, it is taken forever.
+template<unsigned Cond> bool exec_spin(const insn &i) {
+    if (!test<Cond>()) {
+        r.PC = i.next;
+        return false;
+    }
+    r.PC = i.pc;
+    guest.hang_reason = "jump to self";
+    return false;
+}
+bool exec_halt(const insn &i) {
+    r.PC = i.next;
+    cpu.halted = true;
+    return false;
+}
+// Pseudo instruction ending a block early, either at the length limit or
+// in front of an instruction that block::step hands to the interpreter.
+bool exec_end(const insn &i) {
+    r.PC = i.pc;
+    return false;
+}
+
+u8 *reg8(unsigned index, u32 *index_reg = nullptr) {
+    switch (index) {
+        case 0: return &r.B;
+        case 1: return &r.C;
+        case 2: return &r.D;
+        case 3: return &r.E;
+        case 4: return index_reg ? reinterpret_cast<u8 *>(index_reg) + 1 : &r.H;
+        case 5: return index_reg ? reinterpret_cast<u8 *>(index_reg) : &r.L;
+        default: return &r.A;
+    }
+}
+u32 *reg24(unsigned index, u32 *index_reg = nullptr) {
+    switch (index) {
+        case 0: return &r.BC;
+        case 1: return &r.DE;
+        case 2: return index_reg ? index_reg : &r.HL;
+        default: return &r.SPL;
+    }
+}
+
+template<alu Op> bool (*alu_exec(kind operand))(const insn &) {
+    switch (operand) {
+        case reg: return exec_alu<Op, reg>;
+        case mem: return exec_alu<Op, mem>;
+        default: return exec_alu<Op, imm>;
+    }
+}
+bool (*alu_exec(unsigned op, kind operand))(const insn &) {
+    switch (op) {
+        case 0: return alu_exec<alu::add>(operand);
+        case 1: return alu_exec<alu::adc>(operand);
+        case 2: return alu_exec<alu::sub>(operand);
+        case 3: return alu_exec<alu::sbc>(operand);
+        case 4: return alu_exec<alu::and_>(operand);
+        case 5: return alu_exec<alu::xor_>(operand);
+        case 6: return alu_exec<alu::or_>(operand);
+        default: return alu_exec<alu::cp>(operand);
+    }
+}
+template<kind Kind> bool (*cb_exec(unsigned op))(const insn &) {
+    switch (op >> 3) {
+        case 0: return exec_shift<0, Kind>;
+        case 1: return exec_shift<1, Kind>;
+        case 2: return exec_shift<2, Kind>;
+        case 3: return exec_shift<3, Kind>;
+        case 4: return exec_shift<4, Kind>;
+        case 5: return exec_shift<5, Kind>;
+        case 6: return nullptr;
+        case 7: return exec_shift<7, Kind>;
+    }
+    switch (op >> 6) {
+        case 1: return exec_bit<Kind>;
+        case 2: return exec_res<Kind>;
+        default: return exec_set<Kind>;
+    }
+}
+template<template<unsigned> class Exec> auto cond_exec(unsigned cond) {
+    switch (cond) {
+        case 0: return Exec<0>::exec;
+        case 1: return Exec<1>::exec;
+        case 2: return Exec<2>::exec;
+        case 3: return Exec<3>::exec;
+        case 4: return Exec<4>::exec;
+        case 5: return Exec<5>::exec;
+        case 6: return Exec<6>::exec;
+        case 7: return Exec<7>::exec;
+        default: return Exec<8>::exec;
+    }
+}
+template<unsigned Cond> struct jp_exec { static constexpr auto exec = exec_jp<Cond>; };
+template<unsigned Cond> struct spin_exec { static constexpr auto exec = exec_spin<Cond>; };
+template<unsigned Cond> struct call_exec { static constexpr auto exec = exec_call<Cond>; };
+template<unsigned Cond> struct ret_exec { static constexpr auto exec = exec_ret<Cond>; };
+
+// Whether a DD or FD prefix gives op an IX or IY form.
+bool indexable(u8 op) {
+    u8 x = op >> 6, y = op >> 3 & 7, z = op & 7;
+    switch (x) {
+        case 0:
+            switch (op) {
+                case 0x07: case 0x0F: case 0x17: case 0x1F: case 0x27: case 0x2F: case 0x31: case 0x37: case 0x3E: case 0x3F:
+                case 0x21: case 0x22: case 0x23: case 0x2A: case 0x2B:
+                    return true;
+            }
+            return (z == 1 && y & 1) || (z >= 4 && z <= 6 && y >= 4 && y <= 6);
+        case 1:
+            return op != 0x76 && ((y >= 4 && y <= 6) || (z >= 4 && z <= 6));
+        case 2:
+            return z >= 4 && z <= 6;
+        default:
+            return op == 0xCB || op == 0xE1 || op == 0xE3 || op == 0xE5 || op == 0xE9 || op == 0xF9;
+    }
+}
+
+// Decodes the ADL instruction at pc into i, returning false for anything
+// that should be left to the interpreter.  Sets branch for instructions that
+// end a block.
+bool decode(u32 pc, insn &i, bool &branch) {
+    u32 offset = pc - ram_start;
+    if (offset > ram_size - 5)
+        return false;
+    const u8 *p = &ram[offset];
+    auto imm24 = [](const u8 *p) -> u32 { return p[0] | p[1] << 8 | p[2] << 16; };
+    u32 *index_reg = nullptr, *other_reg = nullptr;
+    u32 length = 1, accesses = 0;
+    i = insn{};
+    i.pc = pc;
+    i.yy = &zero;
+    if (*p == 0xDD || *p == 0xFD) {
+        index_reg = *p == 0xDD ? &r.IX : &r.IY;
+        other_reg = *p == 0xDD ? &r.IY : &r.IX;
+        ++p;
+        ++length;
+    }
+    u8 op = *p, x = op >> 6, y = op >> 3 & 7, z = op & 7;
+    if (index_reg && !indexable(op))
+        return false;
+    // Memory operand (hl) or (ix+d), consuming the displacement.
+    auto mem_operand = [&] {
+        if (index_reg) {
+            i.yy = index_reg;
+            i.n = s8(p[1]);
+            ++p;
+            ++length;
+        } else
+            i.yy = &r.HL;
+        ++accesses;
+    };
+    auto finish = [&](bool (*exec)(const insn &)) {
+        i.exec = exec;
+        i.next = pc + length;
+        i.cycles = (length + accesses) * access_cycles;
+        return exec != nullptr;
+    };
+    auto finish_branch = [&](bool (*exec)(const insn &)) {
+        branch = true;
+        return finish(exec);
+    };
+    auto finish_jump = [&](unsigned cond) {
+        return finish_branch(i.n == pc ? cond_exec<spin_exec>(cond) : cond_exec<jp_exec>(cond));
+    };
+    switch (x) {
+        case 0:
+            switch (op) {
+                case 0x00: return finish(exec_nop);
+                case 0x07: case 0x17: case 0x27: case 0x37: case 0x31:
+                case 0x0F: case 0x1F: case 0x2F: case 0x3F: case 0x3E:
+                    if (!index_reg)
+                        switch (op) {
+                            case 0x27: return false;
+                            case 0x2F: return finish(exec_cpl);
+                            case 0x37: return finish(exec_scf);
+                            case 0x3F: return finish(exec_ccf);
+                            default: goto unprefixed;
+                        }
+                    i.xx = op == 0x31 || op == 0x3E ? other_reg : y >> 1 == 3 ? index_reg : reg24(y >> 1);
+                    mem_operand();
+                    accesses += 2;
+                    // Odd y stores: 0F/1F/2F/3F and 3E, against loads 07/17/27/37 and 31.
+                    return finish(y & 1 ? exec_ld24_store : exec_ld24_load);
+                case 0x02: case 0x12: case 0x0A: case 0x1A:
+                    i.x = i.y = &r.A;
+                    i.yy = op & 0x10 ? &r.DE : &r.BC;
+                    accesses = 1;
+                    return finish(op & 8 ? exec_ld<reg, mem> : exec_ld<mem, reg>);
+                case 0x08: return finish(exec_ex_af);
+                case 0x10: case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+                    length = 2;
+                    i.n = (pc + 2 + s8(p[1])) & mask24;
+                    if (op == 0x10)
+                        return finish_branch(exec_djnz);
+                    return finish_jump(op == 0x18 ? 8 : y - 4);
+                case 0x22: case 0x2A:
+                    i.xx = reg24(2, index_reg);
+                    i.n = imm24(&p[1]);
+                    length += 3;
+                    accesses = 3;
+                    return finish(op == 0x2A ? exec_ld24_load : exec_ld24_store);
+                case 0x32: case 0x3A:
+                    i.x = i.y = &r.A;
+                    i.n = imm24(&p[1]);
+                    length += 3;
+                    accesses = 1;
+                    return finish(op == 0x3A ? exec_ld<reg, mem> : exec_ld<mem, reg>);
+            }
+        unprefixed:
+            switch (z) {
+                case 1:
+                    if (y & 1) {
+                        i.xx = reg24(2, index_reg);
+                        i.yy = reg24(y >> 1, index_reg);
+                        return finish(exec_add24);
+                    }
+                    i.xx = reg24(y >> 1, index_reg);
+                    i.n = imm24(&p[1]);
+                    length += 3;
+                    return finish(exec_lea);
+                case 3:
+                    i.xx = i.yy = reg24(y >> 1, index_reg);
+                    i.n = y & 1 ? mask24 : 1;
+                    return finish(exec_lea);
+                case 4: case 5: case 6:
+                    if (y == 6) {
+                        mem_operand();
+                        if (z == 6) {
+                            i.m = p[1];
+                            ++length;
+                            return finish(exec_ld<mem, imm>);
+                        }
+                        ++accesses;
+                        return finish(z == 4 ? exec_inc<mem> : exec_dec<mem>);
+                    }
+                    i.x = i.y = reg8(y, index_reg);
+                    if (z == 6) {
+                        i.m = p[1];
+                        ++length;
+                        return finish(exec_ld<reg, imm>);
+                    }
+                    return finish(z == 4 ? exec_inc<reg> : exec_dec<reg>);
+                case 7:
+                    switch (y) {
+                        case 0: return finish(exec_shift_a<0>);
+                        case 1: return finish(exec_shift_a<1>);
+                        case 2: return finish(exec_shift_a<2>);
+                        case 3: return finish(exec_shift_a<3>);
+                    }
+            }
+            return false;
+        case 1:
+            if (op == 0x76)
+                return finish_branch(exec_halt);
+            if (!index_reg && y == z && y < 4)
+                return false; // .sis, .lis, .sil and .lil suffixes
+            if (y == 6) {
+                i.y = reg8(z);
+                mem_operand();
+                return finish(exec_ld<mem, reg>);
+            }
+            if (z == 6) {
+                i.x = reg8(y);
+                mem_operand();
+                return finish(exec_ld<reg, mem>);
+            }
+            i.x = reg8(y, index_reg);
+            i.y = reg8(z, index_reg);
+            return finish(exec_ld<reg, reg>);
+        case 2:
+            if (z == 6) {
+                mem_operand();
+                return finish(alu_exec(y, mem));
+            }
+            i.y = reg8(z, index_reg);
+            return finish(alu_exec(y, reg));
+    }
+    switch (op) {
+        case 0xC3: case 0xCD:
+            i.n = imm24(&p[1]);
+            length += 3;
+            if (op == 0xCD)
+                accesses = 3;
+            return op == 0xC3 ? finish_jump(8) : finish_branch(exec_call<8>);
+        case 0xC9:
+            accesses = 3;
+            return finish_branch(exec_ret<8>);
+        case 0xCB: {
+            kind operand = reg;
+            if (index_reg) {
+                mem_operand();
+                operand = mem;
+            }
+            op = p[1];
+            ++length;
+            if (!index_reg && (op & 7) == 6)
+                mem_operand(), operand = mem;
+            else if (!index_reg)
+                i.x = i.y = reg8(op & 7);
+            else if ((op & 7) != 6)
+                return false;
+            if (operand == mem && op >> 6 != 1)
+                ++accesses;
+            i.m = 1 << (op >> 3 & 7);
+            return finish(operand == mem ? cb_exec<mem>(op) : cb_exec<reg>(op));
+        }
+        case 0xD9: return finish(exec_exx);
+        case 0xE3:
+            i.xx = reg24(2, index_reg);
+            accesses = 6;
+            return finish(exec_ex_sp);
+        case 0xE9:
+            i.yy = reg24(2, index_reg);
+            return finish_branch(exec_jp_ind);
+        case 0xEB: return finish(exec_ex_de_hl);
+        case 0xF9:
+            i.xx = &r.SPL;
+            i.yy = reg24(2, index_reg);
+            return finish(exec_lea);
+        case 0xED: break;
+        default:
+            switch (z) {
+                case 0:
+                    accesses = 3;
+                    return finish_branch(cond_exec<ret_exec>(y));
+                case 1: case 5:
+                    accesses = 3;
+                    if (y & 1)
+                        return false;
+                    if (y >> 1 == 3)
+                        return finish(z == 1 ? exec_pop_af : exec_push_af);
+                    i.xx = i.yy = reg24(y >> 1, index_reg);
+                    return finish(z == 1 ? exec_pop : exec_push);
+                case 2: case 4:
+                    i.n = imm24(&p[1]);
+                    length += 3;
+                    if (z == 4)
+                        accesses = 3;
+                    return z == 2 ? finish_jump(y) : finish_branch(cond_exec<call_exec>(y));
+                case 6:
+                    i.m = p[1];
+                    ++length;
+                    return finish(alu_exec(y, imm));
+                case 7:
+                    i.n = y << 3;
+                    accesses = 3;
+                    return finish_branch(exec_call<8>);
+            }
+            return false;
+    }
+    // ED page
+    op = p[1];
+    ++length;
+    x = op >> 6, y = op >> 3 & 7, z = op & 7;
+    auto displacement = [&] {
+        i.n = s8(p[2]);
+        ++length;
+    };
+    switch (op) {
+        case 0x02: case 0x03: case 0x12: case 0x13: case 0x22: case 0x23: case 0x32: case 0x33:
+            i.yy = op & 1 ? &r.IY : &r.IX;
+            i.xx = y >> 1 == 3 ? i.yy : reg24(y >> 1);
+            displacement();
+            return finish(exec_lea);
+        case 0x54: case 0x55:
+            i.xx = op & 1 ? &r.IY : &r.IX;
+            i.yy = op & 1 ? &r.IX : &r.IY;
+            displacement();
+            return finish(exec_lea);
+        case 0x65: case 0x66:
+            i.yy = op == 0x65 ? &r.IX : &r.IY;
+            displacement();
+            accesses = 3;
+            return finish(exec_push);
+        case 0x07: case 0x17: case 0x27: case 0x37: case 0x31:
+        case 0x0F: case 0x1F: case 0x2F: case 0x3F: case 0x3E:
+            i.xx = op == 0x31 || op == 0x3E ? &r.IY : op == 0x37 || op == 0x3F ? &r.IX : reg24(y >> 1);
+            i.yy = &r.HL;
+            accesses = 3;
+            return finish(y & 1 ? exec_ld24_store : exec_ld24_load);
+        case 0x04: case 0x0C: case 0x14: case 0x1C: case 0x24: case 0x2C: case 0x3C:
+            i.y = reg8(y);
+            return finish(exec_alu<alu::tst, reg>);
+        case 0x34:
+            i.yy = &r.HL;
+            accesses = 1;
+            return finish(exec_alu<alu::tst, mem>);
+        case 0x64:
+            i.m = p[2];
+            ++length;
+            return finish(exec_alu<alu::tst, imm>);
+        case 0x44: return finish(exec_neg);
+        case 0x67: case 0x6F:
+            accesses = 2;
+            return finish(op == 0x67 ? exec_rrd : exec_rld);
+        case 0xA0: case 0xA8: case 0xB0: case 0xB8:
+            switch (op) {
+                case 0xA0: return finish(exec_ld_block<+1, false>);
+                case 0xA8: return finish(exec_ld_block<-1, false>);
+                case 0xB0: return finish(exec_ld_block<+1, true>);
+                default: return finish(exec_ld_block<-1, true>);
+            }
+        case 0xA1: case 0xA9: case 0xB1: case 0xB9:
+            switch (op) {
+                case 0xA1: return finish(exec_cp_block<+1, false>);
+                case 0xA9: return finish(exec_cp_block<-1, false>);
+                case 0xB1: return finish(exec_cp_block<+1, true>);
+                default: return finish(exec_cp_block<-1, true>);
+            }
+    }
+    if (x != 1)
+        return false;
+    switch (z) {
+        case 2:
+            i.xx = &r.HL;
+            i.yy = reg24(y >> 1);
+            return finish(y & 1 ? exec_adc24 : exec_sbc24);
+        case 3:
+            i.xx = reg24(y >> 1);
+            i.n = imm24(&p[2]);
+            length += 3;
+            accesses = 3;
+            return finish(y & 1 ? exec_ld24_load : exec_ld24_store);
+        case 4:
+            if (!(y & 1))
+                return false;
+            i.xx = reg24(y >> 1);
+            return finish(exec_mlt);
+    }
+    return false;
+}
+
+void flush_blocks(void) {
+    guest.blocks.clear();
+    std::fill(guest.code_map.begin(), guest.code_map.end(), 0);
+    guest.code_dirty = false;
+}
+
+void translate(block &b, u32 pc) {
+    b.pc = pc;
+    b.epoch = guest.epoch;
+    b.step = false;
+    b.insns.clear();
+    std::fill(std::begin(b.links), std::end(b.links), nullptr);
+    u32 cycles = 0, count = 0;
+    for (bool branch = false; !branch; ) {
+        insn i;
+        if (b.insns.size() == max_block_insns || !decode(pc, i, branch)) {
+            b.step = b.insns.size() != max_block_insns;
+            i = insn{};
+            i.exec = exec_end;
+            i.pc = i.next = pc;
+            i.cycles = cycles;
+            i.count = count;
+            b.insns.push_back(i);
+            break;
+        }
+        i.cycles = cycles += i.cycles;
+        i.count = ++count;
+        b.insns.push_back(i);
+        pc = i.next;
+    }
+    b.bytes.assign(&ram[b.pc - ram_start], &ram[pc - ram_start]);
+    std::fill(&guest.code_map[b.pc - ram_start], &guest.code_map[pc - ram_start], 1);
+}
+
+// Runs one instruction in the interpreter.  Whatever it wrote is unknown, so
+// every block is revalidated against its guest bytes before running again.
+void step(void) {
+    trace(trace_kind::step, r.PC, cpu.cycles);
+    auto deadline = sched.event.cycle;
+    u32 sp = r.SPL;
+    sched.event.cycle = cpu.cycles + 1;
+    cpu_flush(r.PC, cpu.ADL);
+    cpu_execute();
+    sched.event.cycle = deadline;
+    // Of what the interpreter writes, only pushes are visible to the shadow.
+    if (r.SPL < sp)
+        shadow_set(r.SPL, sp - r.SPL, shadow::defined);
+    ++guest.instructions;
+    ++guest.epoch;
+    guest.side_effects = true;
+}
+
+// Steps the interpreter for a traced run and records the bytes the
+// instruction changed.  CEmu's stores are out of sight, so the bytes at every
+// address the instruction could store to, going by its operands and the
+// registers, are compared before and after.  A store that leaves a byte as it
+// was, or that lands outside ram, goes unrecorded.
+void step_traced(void) {
+    u32 pc = r.PC;
+    auto code = [pc](u32 index) { u8 *p = span(pc + index, 1); return p ? *p : u8(0); };
+    // Skip a .SIS, .LIS, .SIL or .LIL suffix.
+    u8 first = code(0);
+    u32 at = first == 0x40 || first == 0x49 || first == 0x52 || first == 0x5B;
+    auto imm = [&](u32 index) { return u32(code(at + index) | code(at + index + 1) << 8 | code(at + index + 2) << 16); };
+    s8 displacement = s8(code(at + 2));
+    const u32 candidates[] = {r.HL, r.DE, r.BC, r.IX + displacement, r.IY + displacement,
+                              imm(1), imm(2), r.SPL - 6, r.SPL - 3, r.SPL};
+    u8 before[std::size(candidates)][3];
+    for (size i = 0; i != std::size(candidates); ++i)
+        if (u8 *p = span(candidates[i] & mask24, 3))
+            std::memcpy(before[i], p, 3);
+    step();
+    u32 written[std::size(candidates) * 3], count = 0;
+    for (size i = 0; i != std::size(candidates); ++i)
+        if (u8 *p = span(candidates[i] & mask24, 3))
+            for (u32 j = 0; j != 3; ++j) {
+                u32 address = (candidates[i] & mask24) + j;
+                if (p[j] != before[i][j] && std::find(written, written + count, address) == written + count) {
+                    written[count++] = address;
+                    trace(trace_kind::write, address, p[j]);
+                }
+            }
+}
+
+block *find_block(block *from, u32 pc) {
+    if (from)
+        for (auto *link : from->links)
+            if (link && link->pc == pc && link->epoch == guest.epoch)
+                return link;
+    auto [entry, inserted] = guest.blocks.try_emplace(pc);
+    auto *b = &entry->second;
+    if (inserted)
+        translate(*b, pc);
+    else if (b->epoch != guest.epoch) {
+        if (std::memcmp(b->bytes.data(), &ram[pc - ram_start], b->bytes.size()))
+            translate(*b, pc);
+        b->epoch = guest.epoch;
+    }
+    if (from)
+        from->links[from->links[0] && from->links[0] != b] = b;
+    return b;
+}
+
+void init_blocks(void) {
+    guest.code_map.assign(ram_size, 0);
+}
+
+// Brent's cycle detection over the register file at block entries.  With no
+// side effects in between, the same registers at the same pc can only lead
+// back to the same place again.
+
+bool state_repeated(void) {
+    if (!guest.side_effects && r.PC == guest.loop.saved.PC && !std::memcmp(&r, &guest.loop.saved, sizeof(r)))
+        return true;
+    if (guest.side_effects || ++guest.loop.length == guest.loop.power) {
+        guest.loop.power = guest.side_effects ? 1 : guest.loop.power * 2;
+        guest.loop.length = 0;
+        guest.loop.saved = r;
+        guest.side_effects = false;
+    }
+    return false;
+}
+
+// Edge coverage for --coverage=FILE, AFL style.  Every block entry bumps the
+// counter of hash(previous block) >> 1 ^ hash(block) in a 64 KiB map, so the
+// same code reached from different places counts separately.  Only the block
+// engine records edges, so coverage implies --blocks, and with it the block
+// engine's estimated cycle counts: a coverage run can time out where the
+// interpreter would not, or finish where it would time out.
+//
+// FILE gets a u32 count of nonzero entries, then a bitmask of the libcalls
+// that were hit in libcall.def order, then one u16 index and u8 bucket per
+// entry, all little endian.  Buckets have one bit per magnitude class
+// (1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+) so maps merge with a plain or.
+const char *coverage_path;
+
+void start_coverage(void) {
+    guest.coverage.edges.fill(0);
+    guest.coverage.previous = 0;
+    std::fill(std::begin(guest.coverage.libcalls), std::end(guest.coverage.libcalls), false);
+}
+
+void cover(u32 pc) {
+    u16 current = (pc * 0x9E3779B1u) >> 16;
+    auto &count = guest.coverage.edges[current ^ guest.coverage.previous];
+    count += count != 0xFF;
+    guest.coverage.previous = current >> 1;
+}
+
+u8 bucket(u8 count) {
+    return count < 4 ? u8(1) << (count - 1) : count < 8 ? 8 : count < 16 ? 16 : count < 32 ? 32 : count < 128 ? 64 : 128;
+}
+
+void write_coverage(void) {
+    std::FILE *file = std::fopen(coverage_path, "wb");
+    if (!file) {
+        std::perror(coverage_path);
+        return;
+    }
+    std::vector<u8> bytes(4);
+    u32 entries = 0;
+    for (size index = 0; index < std::size(guest.coverage.libcalls); index += 8) {
+        u8 mask = 0;
+        for (size bit = 0; bit != 8 && index + bit != std::size(guest.coverage.libcalls); ++bit)
+            mask |= guest.coverage.libcalls[index + bit] << bit;
+        bytes.push_back(mask);
+    }
+    for (size index = 0; index != guest.coverage.edges.size(); ++index)
+        if (u8 count = guest.coverage.edges[index]) {
+            bytes.insert(bytes.end(), {u8(index), u8(index >> 8), bucket(count)});
+            ++entries;
+        }
+    for (int shift = 0; shift != 32; shift += 8)
+        bytes[shift / 8] = u8(entries >> shift);
+    bool written = std::fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    if (std::fclose(file) || !written)
+        std::perror(coverage_path);
+}
+
+// Runs until the guest halts or the cycle deadline passes, like cpu_execute.
+// Fast mode leaves cycles alone and stops at the instruction limit instead.
+template<bool Fast> void run_blocks(void) {
+    block *b = nullptr;
+    guest.side_effects = true;
+    while (!cpu.halted && !guest.hang_reason &&
+           (Fast ? guest.instructions < instruction_limit : cpu.cycles < sched.event.cycle)) {
+        if (guest.code_dirty) {
+            flush_blocks();
+            b = nullptr;
+        }
+        if (!cpu.ADL || cpu.IEF1 || r.PC - ram_start >= ram_size) {
+            step();
+            continue;
+        }
+        if (state_repeated()) {
+            guest.hang_reason = "repeated state without side effects";
+            break;
+        }
+        if (coverage_path)
+            cover(r.PC);
+        trace(trace_kind::block, r.PC, cpu.cycles);
+        b = find_block(b, r.PC);
+        const insn *i = b->insns.data();
+        if (shadow_enabled)
+            while (guest.shadow_pc = i->pc, i->exec(*i))
+                ++i;
+        else
+            while (i->exec(*i))
+                ++i;
+        if (r.PC != i->next)
+            trace(trace_kind::branch, i->pc, r.PC);
+        if constexpr (!Fast)
+            cpu.cycles += i->cycles;
+        guest.instructions += i->count;
+        if (b->step && i == &b->insns.back() && !guest.code_dirty)
+            step();
+    }
+}
+
+// Whether the instruction at pc is an unconditional jump to itself.
+bool self_jump(u32 pc) {
+    u32 offset = pc - ram_start;
+    if (offset > ram_size - 4)
+        return false;
+    const u8 *p = &ram[offset];
+    return (p[0] == 0x18 && p[1] == 0xFE) || (p[0] == 0xC3 && u32(p[1] | p[2] << 8 | p[3] << 16) == pc);
+}
+
+// The interpreter runs in slices, so that a guest spinning on a jump to
+// itself is caught long before the deadline.  With interrupts enabled that is
+// just waiting for one.  A traced run single-steps instead, so that the ring
+// sees every instruction.
+constexpr u64 slice_cycles = 1 << 20;
+// A slice can end inside LDIR, LDDR, CPIR or CPDR, which CEmu repeats a byte
+// at a time; those still running then, the long ones, finish on the host
+// through the block engine's fast paths and checks.  INIR, OTIR and the
+// other I/O repeats stay with CEmu, since they go through ports.
+void finish_block_op(void) {
+    u32 offset = r.PC - ram_start;
+    if (!cpu.ADL || offset > ram_size - 2 || ram[offset] != 0xED)
+        return;
+    u8 x;
+    switch (ram[offset + 1]) {
+        case 0xB0:
+            if (!ld_block_fast<+1>())
+                return;
+            ld_block_flags();
+            break;
+        case 0xB8:
+            if (!ld_block_fast<-1>())
+                return;
+            ld_block_flags();
+            break;
+        case 0xB1:
+            if (!cp_block_fast<+1>(x))
+                return;
+            cp_block_flags(x, r.A - x);
+            break;
+        case 0xB9:
+            if (!cp_block_fast<-1>(x))
+                return;
+            cp_block_flags(x, r.A - x);
+            break;
+        default:
+            return;
+    }
+    cpu_flush(r.PC + 2, cpu.ADL);
+}
+void run_interpreter(void) {
+    auto deadline = sched.event.cycle;
+    while (!cpu.halted && cpu.cycles < deadline) {
+        if (guest.trace_ring.empty()) {
+            sched.event.cycle = std::min<u64>(deadline, cpu.cycles + slice_cycles);
+            cpu_execute();
+        } else
+            step_traced();
+        if (!cpu.halted)
+            finish_block_op();
+        if (!cpu.halted && cpu.ADL && !cpu.IEF1 && self_jump(r.PC)) {
+            guest.hang_reason = "jump to self";
+            break;
+        }
+    }
+    sched.event.cycle = deadline;
+}
+
+// Profiler for --profile=FILE.  Every instruction is single-stepped by the
+// interpreter and its cycles are charged to its pc and to the innermost frame
+// of a shadow call stack.  A frame is pushed when an instruction leaves a
+// return address just past itself on the stack and jumps elsewhere, and is
+// popped once the stack pointer rises above that return address.  Folded
+// stacks go to FILE and flat tables to stderr.
+const char *profile_path;
+constexpr size profile_top = 25;
+// Symbols from --symbols=FILE, sorted by address.
+std::vector<std::pair<u32, std::string>> symbols;
+
+// Accepts "name = $address" and "address name" lines, ignoring the rest.
+bool load_symbols(const char *path) {
+    std::FILE *file = std::fopen(path, "r");
+    if (!file) {
+        std::perror(path);
+        return false;
+    }
+    char line[256], name[256];
+    unsigned address;
+    while (std::fgets(line, sizeof(line), file))
+        if (std::sscanf(line, "%255s = $%x", name, &address) == 2 || std::sscanf(line, "%x %255s", &address, name) == 2)
+            symbols.emplace_back(address, name);
+    std::fclose(file);
+    std::sort(symbols.begin(), symbols.end());
+    return true;
+}
+
+// Names the function containing address, falling back to libcall stub names
+// and then to the address itself.
+std::string symbolize(u32 address) {
+    if (u32 offset = address + 1 - ram_start; offset < guest.libcall_index.size())
+        if (auto index = guest.libcall_index[offset])
+            return libcall_handlers[index - 1].name;
+    auto symbol = std::upper_bound(symbols.begin(), symbols.end(), address,
+                                   [](u32 address, const auto &symbol) { return address < symbol.first; });
+    if (symbol != symbols.begin())
+        return std::prev(symbol)->second;
+    char name[8];
+    std::snprintf(name, sizeof(name), "%06X", address);
+    return name;
+}
+
+void start_profile(void) {
+    guest.profile.nodes.assign(1, profile_node{0, r.PC, 0});
+    guest.profile.children.clear();
+    guest.profile.stack.assign(1, {0, r.SPL});
+    guest.profile.cycles.assign(ram_size, 0);
+    guest.profile.counts.assign(ram_size, 0);
+    std::fill(std::begin(guest.profile.libcalls), std::end(guest.profile.libcalls), libcall_profile{});
+}
+
+void profile_step(void) {
+    auto pop = [] {
+        while (guest.profile.stack.size() > 1 && r.SPL > guest.profile.stack.back().second)
+            guest.profile.stack.pop_back();
+    };
+    pop();
+    u32 pc = r.PC, sp = r.SPL;
+    u64 cycles = cpu.cycles;
+    step();
+    u64 spent = cpu.cycles - cycles;
+    if (u32 offset = pc - ram_start; offset < ram_size) {
+        guest.profile.cycles[offset] += spent;
+        ++guest.profile.counts[offset];
+    }
+    guest.profile.nodes[guest.profile.stack.back().first].cycles += spent;
+    pop();
+    if (r.SPL != ((sp - 3) & mask24))
+        return;
+    u32 return_address = read24(r.SPL);
+    if (return_address - pc - 1 >= 6 || r.PC == return_address)
+        return;
+    u32 parent = guest.profile.stack.back().first;
+    auto [child, inserted] = guest.profile.children.try_emplace(u64(parent) << 24 | r.PC, guest.profile.nodes.size());
+    if (inserted)
+        guest.profile.nodes.push_back({parent, r.PC, 0});
+    guest.profile.stack.emplace_back(child->second, r.SPL);
+}
+
+void run_profiled(void) {
+    while (!cpu.halted && cpu.cycles < sched.event.cycle)
+        profile_step();
+}
+
+
+void write_profile(void) {
+    if (std::FILE *file = std::fopen(profile_path, "w")) {
+        std::vector<std::string> stacks(guest.profile.nodes.size());
+        for (u32 node = 0; node != guest.profile.nodes.size(); ++node) {
+            auto &n = guest.profile.nodes[node];
+            stacks[node] = (node ? stacks[n.parent] + ";" : "") + symbolize(n.entry);
+            if (n.cycles)
+                std::fprintf(file, "%s %llu\n", stacks[node].c_str(), (unsigned long long)n.cycles);
+        }
+        std::fclose(file);
+    } else
+        std::perror(profile_path);
+
+    std::unordered_map<std::string, std::pair<u64, u64>> flat;
+    u64 total = 0;
+    for (u32 offset = 0; offset != ram_size; ++offset)
+        if (guest.profile.counts[offset]) {
+            auto &entry = flat[symbolize(ram_start + offset)];
+            entry.first += guest.profile.cycles[offset];
+            entry.second += guest.profile.counts[offset];
+            total += guest.profile.cycles[offset];
+        }
+    std::vector<std::pair<std::string, std::pair<u64, u64>>> rows(flat.begin(), flat.end());
+    std::sort(rows.begin(), rows.end(), [](const auto &x, const auto &y) { return x.second.first > y.second.first; });
+    std::fprintf(stderr, "%12s %6s %12s  %s\n", "cycles", "%", "instructions", "symbol");
+    for (size row = 0; row != rows.size() && row != profile_top; ++row)
+        std::fprintf(stderr, "%12llu %6.2f %12llu  %s\n", (unsigned long long)rows[row].second.first,
+                     total ? 100.0 * rows[row].second.first / total : 0.0,
+                     (unsigned long long)rows[row].second.second, rows[row].first.c_str());
+
+    std::vector<size> libcalls;
+    for (size index = 0; index != std::size(guest.profile.libcalls); ++index)
+        if (guest.profile.libcalls[index].calls)
+            libcalls.push_back(index);
+    std::sort(libcalls.begin(), libcalls.end(), [](size x, size y) {
+        return guest.profile.libcalls[x].time > guest.profile.libcalls[y].time;
+    });
+    std::fprintf(stderr, "\n%12s %12s  %s\n", "calls", "host us", "libcall");
+    for (size index : libcalls)
+        std::fprintf(stderr, "%12llu %12.1f  %s\n", (unsigned long long)guest.profile.libcalls[index].calls,
+                     std::chrono::duration<double, std::micro>(guest.profile.libcalls[index].time).count(),
+                     libcall_handlers[index].name);
+}
+
+// Run statistics for --stats=json, reported on stderr.  Nothing is measured
+// unless they are enabled.
+bool stats_enabled;
+
+bool dispatch_libcall(void) {
+    if (!guest.trace_ring.empty()) {
+        u32 offset = r.PC - ram_start;
+        u32 index = offset < guest.libcall_index.size() ? guest.libcall_index[offset] : 0;
+        u32 sp = r.SPL - ram_start;
+        trace(trace_kind::libcall, r.PC, index << 24 | (sp < ram_size - 2 ? read24(r.SPL) : 0));
+    }
+    if (!profile_path && !stats_enabled && !coverage_path)
+        return emulate_libcall();
+    auto start = std::chrono::steady_clock::now();
+    u32 offset = r.PC - ram_start, sp = r.SPL;
+    bool result = emulate_libcall();
+    auto time = std::chrono::steady_clock::now() - start;
+    if (offset < guest.libcall_index.size())
+        if (auto index = guest.libcall_index[offset]) {
+            if (profile_path) {
+                auto &libcall = guest.profile.libcalls[index - 1];
+                ++libcall.calls;
+                libcall.time += time;
+            }
+            ++guest.stats.calls[index - 1];
+            guest.coverage.libcalls[index - 1] = true;
+        }
+    guest.stats.libcalls += time;
+    guest.stats.lowest_sp = std::min(guest.stats.lowest_sp, sp);
+    return result;
+}
+
+void start_stats(void) {
+    std::fill(std::begin(guest.stats.calls), std::end(guest.stats.calls), 0);
+    guest.stats.libcalls = {};
+    guest.stats.lowest_sp = stack_top;
+    guest.stats.stack.assign(&ram[stack_bottom - ram_start], &ram[stack_top - ram_start]);
+}
+
+// The deepest stack use is the lowest stack byte the guest changed, or the
+// lowest stack pointer seen at a libcall if that went further.
+u32 stack_peak(void) {
+    u32 lowest = guest.stats.lowest_sp;
+    for (u32 address = stack_bottom; address < lowest; ++address)
+        if (ram[address - ram_start] != guest.stats.stack[address - stack_bottom]) {
+            lowest = address;
+            break;
+        }
+    return stack_top - std::min(lowest, stack_top);
+}
+
+void write_stats(u32 status, u32 hl) {
+    auto seconds = [](std::chrono::steady_clock::duration time) {
+        return std::chrono::duration<double>(time).count();
+    };
+    double execute = seconds(guest.stats.execute);
+    std::fprintf(stderr, "{\"status\":%u,\"hl\":%u,\"cycles\":%llu,\"instructions\":", status, hl & mask24,
+                 (unsigned long long)cpu.cycles);
+    if (guest.instructions)
+        std::fprintf(stderr, "%llu", (unsigned long long)guest.instructions);
+    else
+        std::fputs("null", stderr);
+    // Fast mode charges no cycles, so there is no clock rate to report.
+    if (fast_mode)
+        std::fputs(",\"mhz\":null", stderr);
+    else
+        std::fprintf(stderr, ",\"mhz\":%.3f", execute ? cpu.cycles / execute / 1e6 : 0.0);
+    std::fprintf(stderr, ",\"time\":{\"init\":%.6f,\"load\":%.6f,\"execute\":%.6f,\"libcalls\":%.6f}",
+                 seconds(guest.stats.init), seconds(guest.stats.load), execute, seconds(guest.stats.libcalls));
+    std::fprintf(stderr, ",\"stack_peak\":%u,\"heap_peak\":%u,\"libcalls\":{", stack_peak(), guest.heap.peak);
+    const char *separator = "";
+    for (size index = 0; index != std::size(guest.stats.calls); ++index)
+        if (guest.stats.calls[index]) {
+            std::fprintf(stderr, "%s\"%s\":%llu", separator, libcall_handlers[index].name,
+                         (unsigned long long)guest.stats.calls[index]);
+            separator = ",";
+        }
+    std::fputs("}}\n", stderr);
+}
+
+// Reports what --shadow found, returning whether there was anything.
+bool write_shadow(void) {
+    auto name = [](u32 address) { return symbols.empty() ? ""s : " (" + symbolize(address) + ")"; };
+    for (auto &finding : guest.shadow_findings)
+        std::fprintf(stderr, "Shadow: %s at %06X%s by %06X%s\n", finding.what, finding.address,
+                     name(finding.address).c_str(), finding.pc, name(finding.pc).c_str());
+    if (guest.shadow_count)
+        std::fprintf(stderr, "Shadow: %llu findings\n", (unsigned long long)guest.shadow_count);
+    return guest.shadow_count;
+}
+
+void write_trace(void) {
+    std::FILE *file = std::fopen(trace_path, "wb");
+    if (!file) {
+        std::perror(trace_path);
+        return;
+    }
+    u32 count = std::min(guest.trace_head, trace_size);
+    std::vector<u8> bytes(std::begin(trace_magic), std::end(trace_magic));
+    auto put32 = [&](u32 value) {
+        for (int shift = 0; shift != 32; shift += 8)
+            bytes.push_back(value >> shift);
+    };
+    put32(count);
+    for (u32 index = guest.trace_head - count; index != guest.trace_head; ++index) {
+        put32(guest.trace_ring[index & (trace_size - 1)].word);
+        put32(guest.trace_ring[index & (trace_size - 1)].value);
+    }
+    bool written = std::fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    if (std::fclose(file) || !written)
+        std::perror(trace_path);
+    else
+        std::fprintf(stderr, "Trace of the last %u events written to %s\n", count, trace_path);
+}
+
+// Where a run that times out saves its state, see write_checkpoint.
+const char *checkpoint_path;
+void write_checkpoint(void);
+
+// Carries on from the current machine state until the guest exits or the
+// deadline passes, and returns its exit status.
+u32 run_until(u64 deadline) {
+    resolve_libcalls();
+    flush_blocks();
+    guest.hang_reason = nullptr;
+    sched.event.cycle = deadline;
+    if (profile_path)
+        start_profile();
+    if (stats_enabled)
+        start_stats();
+    if (coverage_path)
+        start_coverage();
+    if (trace_path)
+        guest.trace_ring.assign(trace_size, {});
+    guest.trace_head = 0;
+    const char *error = nullptr;
+    try {
+        do
+            if (profile_path)
+                run_profiled();
+            else if (fast_mode)
+                run_blocks<true>();
+            else if (use_blocks)
+                run_blocks<false>();
+            else
+                run_interpreter();
+        while (cpu.halted && !guest.hang_reason && dispatch_libcall() && !guest.expect.diverged);
+    } catch (const char *what) {
+        error = what;
+    }
+    u32 offset = r.PC - ram_start;
+    bool exited = !error && !guest.hang_reason && cpu.halted && offset < guest.libcall_index.size() &&
+        guest.libcall_index[offset] && !std::strcmp(libcall_handlers[guest.libcall_index[offset] - 1].name, "exit");
+    bool overrun = exited && !heap_intact();
+    bool abnormal = (!exited && !guest.expect.diverged) || overrun;
+    if (error)
+        std::fprintf(stderr, "Error at %06X: %s\n", u32(r.PC), error);
+    if (guest.hang_reason)
+        std::fprintf(stderr, "Hang detected at %06X: %s\n", u32(r.PC), guest.hang_reason);
+    // Before the status below overwrites the guest's hl.
+    if (checkpoint_path && !error && !guest.hang_reason && !cpu.halted && !guest.expect.diverged)
+        write_checkpoint();
+    if (error)
+        r.HL = 134;
+    else if (!cpu.halted || guest.hang_reason)
+        r.HL = 124;
+    else if (overrun)
+        r.HL = -1;
+    if (abnormal && trace_path)
+        write_trace();
+    return r.HL;
+}
+
+// Runs the image already in ram from the start and returns its exit status.
+u32 run(void) {
+    guest.instructions = 0;
+    reset_heap();
+    if (shadow_enabled)
+        start_shadow();
+    r.SPL = stack_top;
+    cpu_flush(0xD00000, true);
+    return run_until(cycle_limit);
+}
+
+// Server mode initializes the machine once and snapshots it.  Each request
+// restores the snapshot, copying back only the ram pages that differ, and
+// then loads and runs its image with the guest output captured.
+//
+// Requests are "<length>\n<image>", responses are
+// "<status> <cycles> <length>\n<output>".
+struct snapshot {
+    eZ80cpu_t cpu;
+    sched_t sched;
+    std::vector<u8> ram;
+};
+constexpr u32 page_size = 0x400;
+
+void save(snapshot &state) {
+    state.cpu = cpu;
+    state.sched = sched;
+    state.ram.assign(ram, ram + ram_size);
+}
+void restore(const snapshot &state) {
+    cpu = state.cpu;
+    sched = state.sched;
+    for (u32 page = 0; page != ram_size; page += page_size)
+        if (std::memcmp(&ram[page], &state.ram[page], page_size))
+            std::memcpy(&ram[page], &state.ram[page], page_size);
+}
+
+// Reads a whole file, or stdin for "-".
+bool read_file(const char *path, std::vector<u8> &bytes) {
+    std::FILE *file = path == "-"s ? stdin : std::fopen(path, "rb");
+    if (!file) {
+        std::perror(path);
+        return false;
+    }
+    u8 buffer[0x1000];
+    while (auto length = std::fread(buffer, 1, sizeof(buffer), file))
+        bytes.insert(bytes.end(), buffer, buffer + length);
+    if (file != stdin)
+        std::fclose(file);
+    return true;
+}
+
+// Checkpoints for --checkpoint=FILE and --resume=FILE.  A run that reaches
+// its deadline saves the cpu, the ram pages that differ from the freshly
+// initialized machine, the guest output so far and the host heap, and a
+// later run picks up from there with another full budget.  The scheduler
+// holds callbacks that only mean something in the process that wrote them,
+// so a resumed run keeps the fresh one from asic_init; a guest that never
+// enables interrupts only ever sees its deadline.  Structures are stored as
+// they are in memory, so a checkpoint only loads into the build that wrote
+// it.
+constexpr char checkpoint_magic[8] = {'R', 'Z', 'C', 'K', 'P', 'T', '\0', '\0'};
+constexpr u32 checkpoint_version = 1;
+constexpr auto runner_version = __DATE__ " " __TIME__;
+
+void write_checkpoint(void) {
+    std::vector<u8> bytes;
+    auto append = [&](const void *data, size length) {
+        bytes.insert(bytes.end(), static_cast<const u8 *>(data), static_cast<const u8 *>(data) + length);
+    };
+    auto append32 = [&](u32 value) { append(&value, sizeof(value)); };
+    append(checkpoint_magic, sizeof(checkpoint_magic));
+    append32(checkpoint_version);
+    append(runner_version, sizeof(runner_version));
+    append(&cpu, sizeof(cpu));
+    append(&guest.instructions, sizeof(guest.instructions));
+    append32(guest.output.size());
+    append(guest.output.data(), guest.output.size());
+    append32(redzone);
+    append32(guest.heap.start);
+    append32(guest.heap.top);
+    append32(guest.heap.peak);
+    append32(guest.heap.live.size());
+    for (auto &[address, block] : guest.heap.live) {
+        append32(address);
+        append32(block.size);
+        append32(block.order);
+    }
+    for (auto &list : guest.heap.free) {
+        append32(list.size());
+        append(list.data(), list.size() * sizeof(u32));
+    }
+    for (u32 page = 0; page != ram_size; page += page_size)
+        if (std::memcmp(&ram[page], &guest.pristine_ram[page], page_size)) {
+            append32(page);
+            append(&ram[page], page_size);
+        }
+    append32(ram_size);
+    std::FILE *file = std::fopen(checkpoint_path, "wb");
+    if (!file) {
+        std::perror(checkpoint_path);
+        return;
+    }
+    bool written = std::fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    if (std::fclose(file) || !written)
+        std::perror(checkpoint_path);
+    else
+        std::fprintf(stderr, "Checkpoint at %llu cycles written to %s\n", (unsigned long long)cpu.cycles,
+                     checkpoint_path);
+}
+
+// Loads a checkpoint into the freshly initialized machine.
+bool load_checkpoint(const char *path) {
+    std::vector<u8> bytes;
+    if (!read_file(path, bytes))
+        return false;
+    size offset = 0;
+    auto take = [&](void *data, size length) {
+        if (length > bytes.size() - offset)
+            return false;
+        std::memcpy(data, &bytes[offset], length);
+        offset += length;
+        return true;
+    };
+    auto take32 = [&](u32 &value) { return take(&value, sizeof(value)); };
+    char magic[sizeof(checkpoint_magic)], version[sizeof(runner_version)];
+    u32 format, length, count;
+    if (!take(magic, sizeof(magic)) || std::memcmp(magic, checkpoint_magic, sizeof(magic)) || !take32(format) ||
+        format != checkpoint_version) {
+        std::fprintf(stderr, "%s: not a checkpoint\n", path);
+        return false;
+    }
+    if (!take(version, sizeof(version)) || std::memcmp(version, runner_version, sizeof(version))) {
+        std::fprintf(stderr, "%s: written by another build\n", path);
+        return false;
+    }
+    bool ok = take(&cpu, sizeof(cpu)) && take(&guest.instructions, sizeof(guest.instructions)) && take32(length) &&
+        length <= bytes.size() - offset;
+    if (ok) {
+        guest.output.assign(reinterpret_cast<const char *>(&bytes[offset]), length);
+        offset += length;
+    }
+    reset_heap();
+    auto &heap = guest.heap;
+    ok = ok && take32(redzone) && take32(heap.start) && take32(heap.top) && take32(heap.peak) && take32(count);
+    for (u32 address, size, order; ok && count--;) {
+        ok = take32(address) && take32(size) && take32(order);
+        heap.live[address] = {size, u8(order)};
+    }
+    for (auto &list : heap.free)
+        if ((ok = ok && take32(count) && count <= (bytes.size() - offset) / sizeof(u32))) {
+            list.resize(count);
+            take(list.data(), count * sizeof(u32));
+        }
+    for (u32 page; ok && (ok = take32(page)) && page != ram_size;)
+        ok = page < ram_size && !(page % page_size) && take(&ram[page], page_size);
+    if (!ok)
+        std::fprintf(stderr, "%s: truncated checkpoint\n", path);
+    return ok;
+}
+
+void write_result(std::FILE *out, u32 status, unsigned long long cycles) {
+    std::fprintf(out, "%u %llu %zu\n", status, cycles, guest.output.size());
+    std::fwrite(guest.output.data(), 1, guest.output.size(), out);
+}
+bool read_result(std::FILE *in, unsigned &status, unsigned long long &cycles) {
+    unsigned long length;
+    if (std::fscanf(in, "%u %llu %lu", &status, &cycles, &length) != 3 || std::fgetc(in) != '\n')
+        return false;
+    guest.output.resize(length);
+    return std::fread(guest.output.data(), 1, length, in) == length;
+}
+
+bool read_image(std::FILE *in, std::vector<u8> &image) {
+    unsigned long length;
+    if (std::fscanf(in, "%lu", &length) != 1 || std::fgetc(in) != '\n' || length > ram_size)
+        return false;
+    image.resize(length);
+    return std::fread(image.data(), 1, length, in) == length;
+}
+
+void serve(const snapshot &pristine, std::FILE *in, std::FILE *out) {
+    std::vector<u8> image;
+    while (read_image(in, image)) {
+        restore(pristine);
+        std::copy(image.begin(), image.end(), ram);
+        guest.output.clear();
+        write_result(out, u8(run()), cpu.cycles);
+        std::fflush(out);
+    }
+}
+
+// Batch mode runs several images of one test, typically one per optimization
+// level, from a single initialized machine that is restored between them.
+// Each run's output plus its "exit code: N" line is compared against the
+// expected output when there is one and against the first image otherwise.
+// Images that time out are reported but not compared.  Arguments of the
+// form @FILE name a manifest with one image per line.  The exit status is
+// mismatch_status if any image differs, else 1 if any could not be loaded,
+// else 124 if any timed out.  --trace=FILE writes FILE.N for the Nth image,
+// counting from 0, and --checkpoint is refused.
+bool batch_images(const std::vector<const char *> &args, std::vector<std::string> &images) {
+    for (auto *arg : args) {
+        if (*arg != '@') {
+            images.emplace_back(arg);
+            continue;
+        }
+        std::FILE *manifest = std::fopen(arg + 1, "r");
+        if (!manifest) {
+            std::perror(arg + 1);
+            return false;
+        }
+        char line[4096];
+        while (std::fgets(line, sizeof(line), manifest)) {
+            line[std::strcspn(line, "\r\n")] = '\0';
+            if (*line && *line != '#')
+                images.emplace_back(line);
+        }
+        std::fclose(manifest);
+    }
+    return !images.empty();
+}
+
+int batch(const snapshot &pristine, const std::vector<std::string> &images) {
+    std::string reference(guest.expect.bytes.begin(), guest.expect.bytes.end());
+    const char *reference_name = guest.expect.bytes.empty() ? nullptr : "expected output";
+    bool differ = false, failed = false, timeout = false;
+    std::vector<u8> image;
+    auto &output = guest.output;
+    const char *trace_base = trace_path;
+    std::string image_trace;
+    for (size index = 0; index != images.size(); ++index) {
+        auto &name = images[index];
+        if (trace_base) {
+            image_trace = trace_base + "."s + std::to_string(index);
+            trace_path = image_trace.c_str();
+        }
+        image.clear();
+        if (!read_file(name.c_str(), image) || image.size() > ram_size) {
+            std::printf("%s: cannot load\n", name.c_str());
+            failed = true;
+            continue;
+        }
+        restore(pristine);
+        std::copy(image.begin(), image.end(), ram);
+        output.clear();
+        u32 status = u8(run());
+        std::printf("%s: exit code %u, %llu cycles", name.c_str(), status, (unsigned long long)cpu.cycles);
+        if (status == 124) {
+            std::puts(", timed out");
+            timeout = true;
+            continue;
+        }
+        output += "exit code: " + std::to_string(status) + "\n";
+        if (!reference_name) {
+            reference = output;
+            reference_name = name.c_str();
+            std::putchar('\n');
+            continue;
+        }
+        auto [ours, theirs] = std::mismatch(output.begin(), output.end(), reference.begin(), reference.end());
+        if (ours == output.end() && theirs == reference.end()) {
+            std::printf(", matches %s\n", reference_name);
+            continue;
+        }
+        differ = true;
+        std::printf(", differs from %s at offset %zu: expected ", reference_name, size(ours - output.begin()));
+        if (theirs != reference.end())
+            std::printf("0x%02X", u8(*theirs));
+        else
+            std::fputs("end of output", stdout);
+        if (ours != output.end())
+            std::printf(", got 0x%02X\n", u8(*ours));
+        else
+            std::puts(", got end of output");
+    }
+    return failed ? 1 : differ ? mismatch_status : timeout ? 124 : 0;
+}
+
+#ifndef _WIN32
+[[noreturn]] void serve_connections(const snapshot &pristine, int listener) {
+    while (true) {
+        int connection = accept(listener, nullptr, nullptr);
+        if (connection < 0)
+            continue;
+        std::FILE *in = fdopen(connection, "rb"), *out = fdopen(dup(connection), "wb");
+        if (in && out)
+            serve(pristine, in, out);
+        if (in)
+            std::fclose(in);
+        if (out)
+            std::fclose(out);
+    }
+}
+
+// With jobs > 1, the initialized process forks workers that all accept on
+// the same listener.  CEmu keeps its machine in C globals, so concurrent
+// guests need separate address spaces; forking after initialization still
+// gives every worker the pristine state without paying for asic_init again.
+// The parent only supervises, reaping workers that die and forking
+// replacements so that the pool keeps its size.
+int serve_socket(const snapshot &pristine, const char *path, unsigned jobs) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    unlink(path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) ||
+        listen(listener, SOMAXCONN)) {
+        std::perror(path);
+        return 1;
+    }
+    std::signal(SIGPIPE, SIG_IGN);
+    if (jobs <= 1)
+        serve_connections(pristine, listener);
+    auto spawn = [&] {
+        pid_t pid;
+        while ((pid = fork()) < 0) {
+            std::perror("fork");
+            sleep(1);
+        }
+        if (!pid) {
+#ifdef __linux__
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+            serve_connections(pristine, listener);
+        }
+    };
+    for (unsigned job = 0; job != jobs; ++job)
+        spawn();
+    while (true) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR)
+                continue;
+            std::perror("wait");
+            return 1;
+        }
+        if (WIFSIGNALED(status))
+            std::fprintf(stderr, "Worker %d killed by signal %d, restarting\n", int(pid), WTERMSIG(status));
+        else
+            std::fprintf(stderr, "Worker %d exited with status %d, restarting\n", int(pid), WEXITSTATUS(status));
+        spawn();
+    }
+}
+
+int client(const char *path, const char *image) {
+    std::vector<u8> bytes;
+    if (!read_file(image, bytes))
+        return 1;
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connection < 0 || connect(connection, reinterpret_cast<sockaddr *>(&address), sizeof(address))) {
+        std::perror(path);
+        return 1;
+    }
+    std::FILE *in = fdopen(connection, "rb"), *out = fdopen(dup(connection), "wb");
+    std::fprintf(out, "%zu\n", bytes.size());
+    std::fwrite(bytes.data(), 1, bytes.size(), out);
+    std::fflush(out);
+    unsigned status;
+    unsigned long long cycles;
+    if (!read_result(in, status, cycles))
+        return 1;
+    return replay(status);
+}
+
+// Result cache for --cache=DIR.  Entries are named by a hash of the image
+// and of everything else that decides the result, and hold a server-style
+// response.  Each is written under a temporary name and renamed into place,
+// so runners sharing the directory only ever see complete entries.
+const char *cache_dir;
+
+u64 fnv1a(const void *data, size length, u64 hash = 0xCBF29CE484222325) {
+    for (auto *p = static_cast<const u8 *>(data), *end = p + length; p != end; ++p)
+        hash = (hash ^ *p) * 0x100000001B3;
+    return hash;
+}
+
+std::string cache_entry(const std::vector<u8> &image) {
+    char key[128], name[64];
+    int length = std::snprintf(key, sizeof(key), "%s %d %d %llu %llu %u", runner_version, use_blocks, fast_mode,
+                               (unsigned long long)cycle_limit, (unsigned long long)instruction_limit, redzone);
+    u64 hash = fnv1a(key, length, fnv1a(image.data(), image.size()));
+    std::snprintf(name, sizeof(name), "/%016llx-%zu", (unsigned long long)hash, image.size());
+    return cache_dir + std::string(name);
+}
+
+bool load_cached(const std::string &entry, unsigned &status) {
+    std::FILE *file = std::fopen(entry.c_str(), "rb");
+    if (!file)
+        return false;
+    unsigned long long cycles;
+    bool hit = read_result(file, status, cycles);
+    std::fclose(file);
+    return hit;
+}
+
+void store_cached(const std::string &entry, u32 status) {
+    auto temporary = entry + "." + std::to_string(getpid());
+    if (std::FILE *file = std::fopen(temporary.c_str(), "wb")) {
+        write_result(file, status, cpu.cycles);
+        if (std::fclose(file) || std::rename(temporary.c_str(), entry.c_str()))
+            std::remove(temporary.c_str());
+    }
+}
+#endif
+
+int decode_trace(const char *path) {
+    std::vector<u8> bytes;
+    if (!read_file(path, bytes))
+        return 1;
+    auto get32 = [&](size offset) {
+        return u32(bytes[offset] | bytes[offset + 1] << 8 | bytes[offset + 2] << 16 | bytes[offset + 3] << 24);
+    };
+    if (bytes.size() < 12 || std::memcmp(bytes.data(), trace_magic, sizeof(trace_magic)) ||
+        bytes.size() != 12 + size(get32(8)) * 8) {
+        std::fprintf(stderr, "%s: not a trace\n", path);
+        return 1;
+    }
+    auto name = [](u32 address) { return symbols.empty() ? ""s : " " + symbolize(address); };
+    for (size offset = 12; offset != bytes.size(); offset += 8) {
+        u32 word = get32(offset), value = get32(offset + 4), address = word & mask24;
+        auto kind = trace_kind(word >> 24);
+        if (size(kind) >= std::size(trace_names)) {
+            std::printf("?       %08X %08X\n", word, value);
+            continue;
+        }
+        std::printf("%-7s %06X%s", trace_names[size(kind)], address, name(address).c_str());
+        switch (kind) {
+        case trace_kind::block:
+        case trace_kind::step:
+            std::printf(" at cycle %u\n", value);
+            break;
+        case trace_kind::branch:
+            std::printf(" -> %06X%s\n", value, name(value).c_str());
+            break;
+        case trace_kind::libcall:
+            std::printf(" %s, returning to %06X%s\n",
+                        value >> 24 && value >> 24 <= std::size(libcall_handlers)
+                            ? libcall_handlers[(value >> 24) - 1].name : "?",
+                        value & mask24, name(value & mask24).c_str());
+            break;
+        case trace_kind::write:
+            std::printf(" = %02X\n", value);
+            break;
+        case trace_kind::copy:
+            std::printf(", %u bytes\n", value);
+            break;
+        }
+    }
+    return 0;
+}
+
+const char *option(const char *arg, const char *name) {
+    auto length = std::strlen(name);
+    return std::strncmp(arg, name, length) ? nullptr : arg + length;
+}
 }
 
 extern "C" {
@@ -319,21 +2974,180 @@ void gui_console_printf(const char *format, ...) {
 }
 
 int main(int argc, char **argv) {
-    if (argc != 2)
+    const char *image = nullptr, *expected = nullptr, *decode_path = nullptr, *resume_path = nullptr, *socket_path = nullptr, *client_path = nullptr;
+    bool server = false, batch_mode = false;
+    std::vector<const char *> more_images;
+    unsigned jobs = 1;
+    const u64 default_cycles = cycle_limit, default_instructions = instruction_limit;
+    for (int arg = 1; arg != argc; ++arg)
+        if (argv[arg] == "--blocks"s)
+            use_blocks = true;
+        else if (argv[arg] == "--fast"s)
+            use_blocks = fast_mode = true;
+        else if (auto value = option(argv[arg], "--cycles="))
+            cycle_limit = std::strtoull(value, nullptr, 0);
+        else if (auto value = option(argv[arg], "--instructions="))
+            instruction_limit = std::strtoull(value, nullptr, 0);
+        else if (auto value = option(argv[arg], "--expect="))
+            expected = value;
+        else if (argv[arg] == "--stats=json"s)
+            stats_enabled = true;
+        else if (auto value = option(argv[arg], "--profile="))
+            profile_path = value;
+        else if (auto value = option(argv[arg], "--coverage="))
+            coverage_path = value;
+        else if (argv[arg] == "--shadow"s)
+            shadow_enabled = true;
+        else if (auto value = option(argv[arg], "--redzone="))
+            redzone = std::strtoul(value, nullptr, 0);
+        else if (auto value = option(argv[arg], "--checkpoint="))
+            checkpoint_path = value;
+        else if (auto value = option(argv[arg], "--resume="))
+            resume_path = value;
+        else if (auto value = option(argv[arg], "--trace="))
+            trace_path = value;
+        else if (auto value = option(argv[arg], "--decode-trace="))
+            decode_path = value;
+        else if (auto value = option(argv[arg], "--symbols=")) {
+            if (!load_symbols(value))
+                return 1;
+        }
+        else if (argv[arg] == "--batch"s)
+            batch_mode = true;
+        else if (argv[arg] == "--serve"s)
+            server = true;
+#ifndef _WIN32
+        else if (auto value = option(argv[arg], "--serve="))
+            server = true, socket_path = value;
+        else if (auto value = option(argv[arg], "--client="))
+            client_path = value;
+        else if (auto value = option(argv[arg], "--jobs="))
+            jobs = std::strtoul(value, nullptr, 0);
+        else if (auto value = option(argv[arg], "--cache="))
+            cache_dir = value;
+#endif
+        else if (!image)
+            image = argv[arg];
+        else
+            more_images.push_back(argv[arg]);
+    if (decode_path)
+        return decode_trace(decode_path);
+    if ((!image && !server && !resume_path) || (!more_images.empty() && !batch_mode))
+        return 1;
+    if (server)
+        checkpoint_path = nullptr;
+    if (resume_path && shadow_enabled) {
+        std::fputs("--shadow needs the whole run and cannot be resumed\n", stderr);
+        return 1;
+    }
+    if (batch_mode && checkpoint_path) {
+        std::fputs("--checkpoint saves a single run and cannot be used with --batch\n", stderr);
         return 1;
+    }
+    std::vector<std::string> images;
+    if (batch_mode) {
+        more_images.insert(more_images.begin(), image);
+        if (!batch_images(more_images, images))
+            return 1;
+    }
+    if (expected && !server) {
+        if (!read_file(expected, guest.expect.bytes))
+            return 1;
+        guest.expect.enabled = !batch_mode;
+    }
+#ifndef _WIN32
+    // The server decides how guests run, so a client can only hand over the
+    // image and check what comes back.
+    if (client_path) {
+        if (server || batch_mode || use_blocks || cycle_limit != default_cycles ||
+            instruction_limit != default_instructions || stats_enabled || profile_path || coverage_path ||
+            shadow_enabled || redzone || checkpoint_path || resume_path || trace_path || cache_dir) {
+            std::fputs("--client only takes an image and --expect\n", stderr);
+            return 1;
+        }
+        return client(client_path, image);
+    }
+#endif
+    if (coverage_path || shadow_enabled)
+        use_blocks = true;
+    auto now = &std::chrono::steady_clock::now;
+    auto start = now();
+    std::vector<u8> bytes;
+    if (!server && !batch_mode && !resume_path && (!read_file(image, bytes) || bytes.size() > ram_size))
+        return 1;
+    guest.stats.load = now() - start;
+#ifndef _WIN32
+    std::string entry;
+    bool cacheable = cache_dir && !batch_mode && !resume_path && !checkpoint_path && !profile_path &&
+        !stats_enabled && !coverage_path && !shadow_enabled && !trace_path;
+    if (cacheable) {
+        entry = cache_entry(bytes);
+        if (unsigned status; load_cached(entry, status))
+            return replay(status);
+    }
+#endif
+    start = now();
     asic_init();
     asic_reset();
-    emu_load(EMU_DATA_RAM, argv[1]);
-    r.SPL = 0xD65800;
-    sched.event.cycle = 48000000 * 10;
-    cpu_flush(0xD00000, true);
-    do
-        cpu_execute();
-    while (cpu.halted && emulate_libcall());
-    if (!cpu.halted)
-        r.HL = 124;
+    ram = static_cast<u8 *>(phys_mem_ptr(ram_start, ram_size));
+    if (use_blocks)
+        init_blocks();
+    if (checkpoint_path)
+        guest.pristine_ram.assign(ram, ram + ram_size);
+    guest.stats.init = now() - start;
+    if (batch_mode) {
+        snapshot pristine;
+        save(pristine);
+        int result = batch(pristine, images);
+        asic_free();
+        return result;
+    }
+    if (server) {
+        snapshot pristine;
+        save(pristine);
+#ifndef _WIN32
+        if (socket_path)
+            return serve_socket(pristine, socket_path, jobs);
+#endif
+        serve(pristine, stdin, stdout);
+        asic_free();
+        return 0;
+    }
+    start = now();
+    if (resume_path) {
+        if (!load_checkpoint(resume_path))
+            return 1;
+        for (char c : guest.output)
+            compare(u8(c));
+        instruction_limit += guest.instructions;
+    } else
+        std::copy(bytes.begin(), bytes.end(), ram);
+    guest.stats.load += now() - start;
+    start = now();
+    u32 status = resume_path ? run_until(cpu.cycles + cycle_limit) : run();
+    guest.stats.execute = now() - start - guest.stats.libcalls;
+    if (profile_path)
+        write_profile();
+    if (stats_enabled)
+        write_stats(u8(status), status);
+    if (coverage_path)
+        write_coverage();
+#ifndef _WIN32
+    if (cacheable && !guest.expect.diverged) {
+        status = u8(status);
+        store_cached(entry, status);
+    }
+#endif
     asic_free();
-    return r.HL;
+    int result = status;
+    if (guest.expect.enabled)
+        result = finish_expect(status);
+    else
+        flush_output();
+    // Findings only turn a clean run into a failure; a nonzero exit code,
+    // mismatch or timeout keeps its own status.
+    bool findings = shadow_enabled && write_shadow();
+    return findings && !result ? 125 : result;
 }
 
 }
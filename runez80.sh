@@ -8,7 +8,13 @@ for warning in bool-operation compare-distinct-pointer-types constant-conversion
 done
 set "$1"
 
+# STAGE=native|compile|assemble|run runs a single stage; one that passes
+# leaves $STAGE.passed behind so a driver can schedule the next one
+stage() { test -z "$STAGE" -o "$STAGE" = "$1"; }
+passed() { test -z "$STAGE" || { touch "$STAGE.passed"; exit 2; }; }
+
 # native
+if stage native; then
 echo compiling native executable...
 #$(readlink -f $(which ez80-clang)) -Xclang -test-ez80-hack $Werror $Wno $CFLAGS -O0 -glldb -o native.elf 2> native.diag || exit
 $(readlink -f $(which ez80-clang)) -Xclang -test-ez80-hack $Werror $Wno $CFLAGS -O0 -glldb -fsanitize=memory,bounds -fsanitize-trap=signed-integer-overflow,unreachable,return,bounds,builtin,bool,shift -o native.elf 2> native.diag || exit
@@ -20,20 +26,29 @@ ec=$?
 cat native.err >&2
 test -s native.err -o $ec -eq 124 -o $ec -eq 132 && exit $ec
 echo "exit code: $ec" >> native.out
+passed
+fi
 
 # ez80
+if stage compile; then
 echo compiling ez80 executable...
 timeout 250s ez80-clang $Wno -S $CFLAGS -o ez80.asm || exit 0
+passed
+fi
+if stage assemble; then
 echo assembling ez80 executable...
 timeout 50s $FASMG -i 'source "ez80.asm"' ez80.bin 2> ez80.err
 ec=$?
 grep '^Error: could not generate code within the allowed number of passes.$\|^Custom error: section [^ ]\+ has a maximum end that is [0-9]\+ bytes before it begins.$' ez80.err && exit $ec
 cat ez80.err >&2
 test $ec -eq 0 || exit 0
+passed
+fi
+if stage run; then
 echo running ez80 executable...
-$RUNEZ80 ez80.bin > ez80.out
+$RUNEZ80 --expect=native.out - < ez80.bin
 ec=$?
 test $ec -eq 124 && exit $ec
-echo "exit code: $ec" >> ez80.out
-
-! diff -U9999 -s native.out ez80.out
+# 3 is the runner's status for a mismatch; anything else is a pass or an error
+test $ec -eq 3
+fi